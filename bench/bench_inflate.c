@@ -0,0 +1,217 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Compares reading all the data of a package through do_archive(), which
+// inflates it with libdeflate when pkgutils is built with it, with the
+// stock libarchive gzip (zlib) reader. Without a package given, a
+// synthetic one is made in $TMPDIR.
+//
+// Usage: bench_inflate [package [rounds]]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/param.h>
+#include <pkgutils/pkgutils.h>
+
+#define BENCH_PKG_SIZE  (64UL << 20)  // of the synthetic package data
+#define BENCH_BUF_SIZE  65536
+
+static const char *words[] = {
+	"static", "void", "int", "return", "struct", "archive", "entry",
+	"package", "size_t", "const", "char", "if", "else", "for", "while",
+	"0x1f", "0x8b", "NULL", "free", "fmalloc", "list_for_each", "die",
+	"{", "}", "(", ")", ";", "\n", "\t", " ", NULL
+};
+
+static unsigned long seed = 1;
+
+static
+unsigned long next_rand(void) {
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return seed >> 33;
+}
+
+static
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes a package of text files, compressing like real ones do
+static
+void make_package(const char *path) {
+	struct archive *ar;
+	struct archive_entry *en;
+	char *buf = fmalloc(1 << 20);
+	char name[64];
+	size_t nwords = 0, total = 0;
+
+	while (words[nwords]) nwords++;
+	ar = archive_write_new();
+	if (!ar) die("archive_write_new");
+	archive_write_set_compression_gzip(ar);
+	archive_write_set_format_ustar(ar);
+	if (archive_write_open_filename(ar, path) != ARCHIVE_OK) {
+		fprintf(stderr, "%s: %s\n", path, archive_error_string(ar));
+		exit(1);
+	}
+	for (int i = 0; total < BENCH_PKG_SIZE; i++) {
+		size_t size = 1024 + next_rand() % (1 << 20) / (1 + i % 8);
+		size_t len = 0;
+
+		while (len < size) {
+			const char *w = words[next_rand() % nwords];
+			size_t wlen = MIN(strlen(w), size - len);
+			memcpy(buf + len, w, wlen);
+			len += wlen;
+		}
+		snprintf(name, sizeof(name), "usr/share/bench/file%05d", i);
+		en = archive_entry_new();
+		if (!en) die("archive_entry_new");
+		archive_entry_set_pathname(en, name);
+		archive_entry_set_mode(en, S_IFREG | 0644);
+		archive_entry_set_size(en, size);
+		if (archive_write_header(ar, en) != ARCHIVE_OK ||
+		    archive_write_data(ar, buf, size) != (ssize_t)size) {
+			fprintf(stderr, "%s: %s\n", path,
+			        archive_error_string(ar));
+			exit(1);
+		}
+		archive_entry_free(en);
+		total += size;
+	}
+	archive_write_finish(ar);
+	free(buf);
+	return;
+}
+
+static
+void read_data(struct archive *ar, struct archive_entry *en, void *total,
+               void *buf) {
+	ssize_t len;
+
+	while ((len = archive_read_data(ar, buf, BENCH_BUF_SIZE)) > 0)
+		*(size_t *)total += len;
+	return;
+}
+
+// the way do_archive() read packages before libdeflate
+static
+int read_stock(FILE *pkg, size_t *total, void *buf) {
+	struct archive *ar;
+	struct archive_entry *en;
+	int err;
+
+	fseek(pkg, 0L, SEEK_SET);
+	ar = archive_read_new();
+	if (!ar) die("archive_read_new");
+	archive_read_support_compression_gzip(ar);
+	archive_read_support_format_tar(ar);
+	if (archive_read_open_FILE(ar, pkg) != ARCHIVE_OK) {
+		archive_read_finish(ar);
+		return -1;
+	}
+	// do_archive() leaves the embedded manifest alone
+	for (int first = 1; (err = archive_read_next_header(ar, &en)) ==
+	                    ARCHIVE_OK; first = 0) {
+		if (!first || strcmp(archive_entry_pathname(en), PKG_MANIFEST))
+			read_data(ar, en, total, buf);
+	}
+	archive_read_finish(ar);
+	return err == ARCHIVE_EOF ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+	char tmp[MAXPATHLEN+1];
+	const char *path = argc > 1 ? argv[1] : NULL;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	double best_stock = 0, best_pkg = 0, t;
+	size_t total_stock = 0, total_pkg = 0;
+	char *buf = fmalloc(BENCH_BUF_SIZE);
+	FILE *pkg;
+	int fd;
+
+	if (rounds < 1) {
+		fprintf(stderr, "Usage: %s [package [rounds]]\n", argv[0]);
+		return 1;
+	}
+	if (!path) {
+		snprintf(tmp, sizeof(tmp), "%s/bench_inflate.XXXXXX",
+		         getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+		fd = mkstemp(tmp);
+		if (fd < 0) die(tmp);
+		close(fd);
+		make_package(tmp);
+		path = tmp;
+	}
+	pkg = fopen(path, "r");
+	if (!pkg) {
+		fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	for (int i = 0; i < rounds; i++) {
+		total_stock = 0;
+		t = now();
+		if (read_stock(pkg, &total_stock, buf)) {
+			fprintf(stderr, "Can't read %s\n", path);
+			return 1;
+		}
+		t = now() - t;
+		if (!i || t < best_stock) best_stock = t;
+
+		total_pkg = 0;
+		t = now();
+		if (do_archive(pkg, read_data, &total_pkg, buf)) {
+			fprintf(stderr, "Can't read %s\n", path);
+			return 1;
+		}
+		t = now() - t;
+		if (!i || t < best_pkg) best_pkg = t;
+	}
+	fclose(pkg);
+	if (path == tmp) unlink(tmp);
+	free(buf);
+	if (total_stock != total_pkg) {
+		fprintf(stderr, "Results differ: %zu and %zu bytes read\n",
+		        total_stock, total_pkg);
+		return 1;
+	}
+
+	printf("%s: %.1f MB of data, best of %d\n", argc > 1 ? path :
+	       "synthetic package", total_pkg / 1e6, rounds);
+	printf("libarchive/zlib %8.1f MB/s\n",
+	       total_stock / 1e6 / best_stock);
+#ifdef HAVE_LIBDEFLATE
+	printf("libdeflate      %8.1f MB/s  %.2fx\n",
+	       total_pkg / 1e6 / best_pkg, best_stock / best_pkg);
+#else
+	printf("do_archive()    %8.1f MB/s  %.2fx, built without libdeflate\n",
+	       total_pkg / 1e6 / best_pkg, best_stock / best_pkg);
+#endif
+	return 0;
+}
@@ -0,0 +1,201 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Compares intersect_uniq() over file list entries with the merge join
+// over path keys pkgadd uses to find conflicts: both sort a package and
+// the database, then intersect them.
+//
+// Usage: bench_join [db files [package files [rounds]]]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+#include <pkgutils/pkgutils.h>
+
+// the directories files are spread over, most share the first 8 bytes
+static const char *dirs[] = {
+	"usr/bin/", "usr/lib/", "usr/include/", "usr/share/man/man1/",
+	"usr/share/locale/de/LC_MESSAGES/", "usr/share/doc/", "etc/", NULL
+};
+
+static unsigned long seed = 1;
+
+static
+unsigned long next_rand(void) {
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return seed >> 33;
+}
+
+static
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Appends n files numbered from first on to files, in random order
+static
+void make_files(list_t *files, size_t first, size_t n) {
+	size_t *ids = fmalloc(n * sizeof(size_t));
+	char path[MAXPATHLEN+1];
+	size_t ndirs = 0;
+
+	while (dirs[ndirs]) ndirs++;
+	for (size_t i = 0; i < n; i++) ids[i] = first + i;
+	for (size_t i = n; i > 1; i--) {
+		size_t j = next_rand() % i, tmp = ids[i-1];
+		ids[i-1] = ids[j];
+		ids[j] = tmp;
+	}
+	for (size_t i = 0; i < n; i++) {
+		pkg_file_t *file = fmalloc(sizeof(pkg_file_t));
+		memset(file, 0, sizeof(pkg_file_t));
+		snprintf(path, sizeof(path), "%sfile-%08zu",
+		         dirs[ids[i] % ndirs], ids[i]);
+		file->path = strdup(path);
+		if (!file->path) die("strdup");
+		list_append(files, file);
+	}
+	free(ids);
+	return;
+}
+
+static
+void count_entry(void **ai, void **bj, void *count) {
+	(*(size_t *)count)++;
+	return;
+}
+
+static inline
+void count_key(path_key_t *ai, path_key_t *bj, void *count) {
+	(*(size_t *)count)++;
+	return;
+}
+
+DEFINE_MERGE_JOIN(join_count, path_key_t, path_key_compare, count_key)
+
+// best times of a way to intersect, in seconds
+typedef struct {
+	double sort, join;
+	size_t count;
+} result_t;
+
+static
+void keep_best(result_t *best, double sort, double join, int first) {
+	if (first || sort < best->sort) best->sort = sort;
+	if (first || join < best->join) best->join = join;
+	return;
+}
+
+// the way pkgadd used to do it, with file_cmp()
+static
+void run_intersect_uniq(list_t *pkg, list_t *db, result_t *best, int first) {
+	void **a = fmalloc(pkg->size * sizeof(void *));
+	void **b = fmalloc(db->size * sizeof(void *));
+	double t0, t1, t2;
+	size_t n = 0;
+
+	t0 = now();
+	list_for_each(_file, pkg) a[n++] = _file;
+	n = 0;
+	list_for_each(_file, db) b[n++] = _file;
+	qsort(a, pkg->size, sizeof(void *), file_cmp);
+	qsort(b, db->size, sizeof(void *), file_cmp);
+	t1 = now();
+	best->count = 0;
+	intersect_uniq(a, pkg->size, b, db->size, file_cmp, count_entry, NULL,
+	               &best->count);
+	t2 = now();
+	keep_best(best, t1 - t0, t2 - t1, first);
+	free(a);
+	free(b);
+	return;
+}
+
+static
+void run_merge_join(list_t *pkg, list_t *db, result_t *best, int first) {
+	path_key_t *a = fmalloc(pkg->size * sizeof(path_key_t));
+	path_key_t *b = fmalloc(db->size * sizeof(path_key_t));
+	double t0, t1, t2;
+
+	t0 = now();
+	path_keys_add(a, pkg);
+	path_keys_add(b, db);
+	path_keys_sort(a, pkg->size);
+	path_keys_sort(b, db->size);
+	t1 = now();
+	best->count = 0;
+	join_count(a, pkg->size, b, db->size, &best->count);
+	t2 = now();
+	keep_best(best, t1 - t0, t2 - t1, first);
+	free(a);
+	free(b);
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	size_t ndb = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	size_t npkg = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+	int rounds = argc > 3 ? atoi(argv[3]) : 10;
+	result_t old, new;
+	list_t db, pkg;
+
+	if (!ndb || !npkg || npkg / 2 > ndb || rounds < 1) {
+		fprintf(stderr, "Usage: %s [db files [package files "
+		        "[rounds]]]\n", argv[0]);
+		return 1;
+	}
+	list_init(&db);
+	list_init(&pkg);
+	make_files(&db, 0, ndb);
+	// half of the package is in the database already
+	make_files(&pkg, ndb - npkg / 2, npkg);
+
+	for (int i = 0; i < rounds; i++) {
+		run_intersect_uniq(&pkg, &db, &old, !i);
+		run_merge_join(&pkg, &db, &new, !i);
+	}
+	if (old.count != new.count) {
+		fprintf(stderr, "Results differ: %zu and %zu common files\n",
+		        old.count, new.count);
+		return 1;
+	}
+
+	printf("%zu database files, %zu package files, %zu common, best of "
+	       "%d, ms\n", ndb, npkg, new.count, rounds);
+	printf("                   sort     join    total\n");
+	printf("intersect_uniq %8.2f %8.2f %8.2f\n", old.sort * 1e3,
+	       old.join * 1e3, (old.sort + old.join) * 1e3);
+	printf("merge join     %8.2f %8.2f %8.2f\n", new.sort * 1e3,
+	       new.join * 1e3, (new.sort + new.join) * 1e3);
+	printf("speedup        %7.2fx %7.2fx %7.2fx\n", old.sort / new.sort,
+	       old.join / new.join,
+	       (old.sort + old.join) / (new.sort + new.join));
+
+	list_for_each(_file, &db) pkg_free_file(_file->data);
+	list_for_each(_file, &pkg) pkg_free_file(_file->data);
+	list_free(&db);
+	list_free(&pkg);
+	return 0;
+}
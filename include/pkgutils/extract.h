@@ -0,0 +1,32 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#pragma once
+#include <archive.h>
+#include <archive_entry.h>
+#include <pkgutils/types.h>
+
+// pipelined extraction: the caller reads the archive and passes entries
+// to extract_entry(), regular files are written by a pool of threads
+extern void extract_begin(void);
+extern int extract_entry(struct archive *ar, struct archive_entry *en,
+                         pkg_file_t *file);
+extern void extract_end(void);
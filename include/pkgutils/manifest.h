@@ -0,0 +1,30 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#pragma once
+#include <stdio.h>
+#include <pkgutils/misc.h>
+
+extern void manifest_init(void);
+extern int do_manifest(FILE *pkg, do_archive_fun_t func, void *arg1,
+                       void *arg2);
+extern int do_manifest_once(const char *fname, do_archive_fun_t func,
+                            void *arg1, void *arg2);
@@ -20,6 +20,8 @@
 //  USA.
 
 #pragma once
+#include <stdint.h>
+#include <string.h>
 #include <pkgutils/types.h>
 #include <archive.h>
 #include <archive_entry.h>
@@ -30,7 +32,12 @@ extern void pkgutils_version(void);
 extern int die(const char *str);
 extern void *fmalloc(size_t size);
 extern const char *base_filename(const char *name);
+extern void make_parents(const char *path);
+extern int write_all(int fd, const void *buf, size_t size);
+extern int copy_fd(int src, int dst);
+extern void remove_tree(const char *path);
 
+extern void pkg_free_file(pkg_file_t *file);
 extern int pkg_cmp(const void *a, const void *b);
 extern int file_cmp(const void *a, const void *b);
 extern void intersect_uniq(void **a, size_t asz, void **b, size_t bsz,
@@ -39,15 +46,83 @@ extern void intersect_uniq(void **a, size_t asz, void **b, size_t bsz,
                            void (*uniqf)(void **ai, void *arg),
                            void *arg);
 
+// Sort key of a database file: the first 16 bytes of the path as two big
+// endian numbers, zero padded, order the same as strcmp() of the path,
+// so the string is only compared when they are equal. 8 bytes would
+// hardly tell apart anything under usr/share.
+#define PATH_KEY_SIZE 16
+
+typedef struct {
+	uint64_t prefix[2];
+	const char *path;
+	list_entry_t *entry;  // of the pkg_file_t in its package
+} path_key_t;
+
+extern void path_key_set(path_key_t *key, const char *path,
+                         list_entry_t *entry);
+extern size_t path_keys_add(path_key_t *keys, list_t *files);
+extern void path_keys_sort(path_key_t *keys, size_t n);
+
+static inline
+int path_key_compare(const path_key_t *a, const path_key_t *b) {
+	if (a->prefix[0] != b->prefix[0])
+		return a->prefix[0] < b->prefix[0] ? -1 : 1;
+	if (a->prefix[1] != b->prefix[1])
+		return a->prefix[1] < b->prefix[1] ? -1 : 1;
+	// both paths end within the prefix
+	if (!(a->prefix[1] & 0xff)) return 0;
+	return strcmp(a->path + PATH_KEY_SIZE, b->path + PATH_KEY_SIZE);
+}
+
+// Defines static void name(type *a, size_t asz, type *b, size_t bsz,
+// void *arg), which does what intersect_uniq() does without uniqf for the
+// arrays of type sorted by cmpf: match(ai, bj, arg) is called for the
+// first elements of a and b with the same key. Comparing and matching
+// are called directly, so the compiler can inline them.
+#define DEFINE_MERGE_JOIN(name, type, cmpf, match)                          \
+static                                                                      \
+void name(type *a, size_t asz, type *b, size_t bsz, void *arg) {            \
+	size_t i, j = 0, next = 0;                                          \
+	int cmp;                                                            \
+                                                                            \
+	for (i = 0; i < asz && next < bsz && j < bsz; i++) {                \
+		for (j = next; j < bsz; j++) {                              \
+			cmp = cmpf(&b[j], &a[i]);                           \
+			if (cmp < 0) continue;                              \
+			if (cmp > 0) {                                      \
+				next = j;                                   \
+				break;                                      \
+			}                                                   \
+			for (next = j + 1; next < bsz &&                    \
+			                   !cmpf(&b[j], &b[next]); next++); \
+			match(&a[i], &b[j], arg);                           \
+			break;                                              \
+		}                                                           \
+	}                                                                   \
+	return;                                                             \
+}
+
 extern pkg_desc_t *pkg_find_pkg(const char *name);
 extern int pkg_make_desc(const char *pkg_path, pkg_desc_t *pkg);
 extern int do_archive(FILE *pkg, do_archive_fun_t func, void *arg1,
                       void *arg2);
+extern int do_archive_fd(int fd, do_archive_fun_t func, void *arg1,
+                         void *arg2);
 extern int do_archive_once(const char *fname, do_archive_fun_t func,
                            void *arg1, void *arg2);
 
 extern int fetch_line_fields(char *line);
 
+#define LDCONFIG_FULL        0
+#define LDCONFIG_INCREMENTAL 1
+
+extern int opt_ldconfig;
+extern void ldconfig_init(void);
+extern void ldconfig_check_data(const char *path, const void *hdr,
+                                size_t size);
+extern void ldconfig_check_at(int dirfd, const char *path,
+                              const char *fspath);
+extern void ldconfig_check_file(const char *path, const char *fspath);
 extern void run_ldconfig(void);
 
 #ifdef DEBUG
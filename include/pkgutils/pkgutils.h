@@ -21,19 +21,36 @@
 
 #pragma once
 #include <sys/types.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <pkgutils/list.h>
 #include <pkgutils/types.h>
 #include <pkgutils/misc.h>
 #include <pkgutils/filemode.h>
+#include <pkgutils/extract.h>
+#include <pkgutils/store.h>
+#include <pkgutils/rollback.h>
+#include <pkgutils/manifest.h>
+#include <pkgutils/seekable.h>
+#include <pkgutils/unlink.h>
+#include <pkgutils/scancache.h>
+#include <pkgutils/walk.h>
 
 #define PKG_EXT         ".pkg.tar.gz"
+// first archive member listing the others, written by pkgmk
+#define PKG_MANIFEST    ".MANIFEST"
 
 #define PKG_ADD_FORCE      1
 #define PKG_ADD_FORCE_PERM 2
 
+#define PKG_SYNC_NONE      0
+#define PKG_SYNC_PACKAGE   1
+#define PKG_SYNC_BATCH     2
+#define PKG_SYNC_FULL      3
+
 // global variables
 extern char *opt_root;
+extern int opt_sync;
 extern list_t pkg_db;
 extern int db_lock;
 
@@ -42,8 +59,18 @@ extern void pkg_lock_db(void);
 extern void pkg_unlock_db(void);
 extern void pkg_init_db(void);
 extern void pkg_free_db(void);
+extern void pkg_read_desc(FILE *pkg_db_file, list_t *pkgs);
+extern void pkg_write_desc(FILE *f, pkg_desc_t *pkg);
+extern void pkg_free_desc(pkg_desc_t *pkg);
 extern int pkg_commit_db(void);
+extern void pkg_update_db(void);
+extern void pkg_end_transaction(void);
 
 // package management
 extern int pkg_add(const char *pkg_path, int opts);
+extern int pkg_add_fd(int fd, const char *pkg_name, int opts);
+extern int pkg_rollback(const char *name, int opts);
+extern int pkg_bootstrap(int npkgs, char *pkg_paths[], int opts);
+extern int pkg_extract(const char *pkg_path, char *paths[], int npaths);
 extern int pkg_rm(const char *pkg_name);
+extern int pkg_rm_pkgs(int npkgs, char *pkg_names[]);
@@ -0,0 +1,37 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#pragma once
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// cached directory listings of pkginfo scans: entries are 'd' or '-'
+// followed by the name and NUL, the last one is empty
+typedef struct scan_cache scan_cache_t;
+
+extern int scan_dir_cmp(const char *a, size_t alen, const char *b,
+                        size_t blen);
+extern scan_cache_t *scan_cache_open(const char *name);
+extern const char *scan_cache_lookup(scan_cache_t *cache, const char *path,
+                                     const struct stat *st);
+extern void scan_cache_put(scan_cache_t *cache, const char *path,
+                           const struct stat *st, const char *entries);
+extern void scan_cache_close(scan_cache_t *cache);
@@ -0,0 +1,37 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#pragma once
+#include <stdio.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <pkgutils/types.h>
+
+// content addressed store of extracted files, shared between roots
+extern char *opt_store;
+extern int opt_store_link;
+
+extern void store_begin(FILE *pkgf, const char *pkg_path);
+extern const char *store_lookup(const char *path);
+extern char *store_put(struct archive *ar, struct archive_entry *en,
+                       const void *buf, size_t size);
+extern int store_place(const char *ref, struct archive_entry *en);
+extern void store_end(pkg_desc_t *pkg);
@@ -42,7 +42,10 @@ typedef struct {
 	pkg_desc_t *pkg;
 	pkg_conflict_type_t conflict;
 	char *path;
+	char *ref;  // content store object, if installed from the store
+	off_t size; // data size of a regular file, -1 if unknown
 	mode_t mode;
+	mode_t type; // S_IFMT bits of the package entry, whatever mode says
 	uid_t uid;
 	gid_t gid;
 } pkg_file_t;
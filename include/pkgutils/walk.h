@@ -0,0 +1,39 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#pragma once
+#include <pkgutils/scancache.h>
+
+// Called for every entry below the root walked by walk_tree(), from
+// several threads at once and in no particular order, to tell whether
+// the entry is reported and, for directories, walked into. path is
+// relative to the root, and valid only during the call. *ctx holds what
+// was left there for the directory the entry is in; for directories it
+// may be changed for their entries.
+typedef int (*walk_filter_t)(const char *path, int is_dir, int *ctx,
+                             void *arg);
+// Called for the entries which passed the filter, in the order of their
+// paths, by the thread which called walk_tree().
+typedef void (*walk_func_t)(const char *path, int is_dir, void *arg);
+
+extern void walk_tree(const char *root, scan_cache_t *cache,
+                      walk_filter_t filter, walk_func_t func, int ctx,
+                      void *arg);
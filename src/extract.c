@@ -0,0 +1,508 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <unistd.h>
+#include <pkgutils/pkgutils.h>
+
+#define EXTRACT_FLAGS       (ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | \
+                             ARCHIVE_EXTRACT_UNLINK)
+#define EXTRACT_MAX_WRITERS 4
+// maximum amount of file data read ahead and waiting for the writers
+#define EXTRACT_QUEUE_SIZE  (32 << 20)
+// files bigger than that are written by the reader thread itself
+#define EXTRACT_INLINE_SIZE (4 << 20)
+// data is written in chunks of that size, at offsets aligned to it
+#define EXTRACT_CHUNK_SIZE  (1 << 20)
+// zero runs of that size, at aligned offsets, are left as holes. Smaller
+// files are written as is.
+#define EXTRACT_HOLE_SIZE   (64 << 10)
+// number of path_slot() values
+#define EXTRACT_PATH_SLOTS  4096
+
+typedef struct {
+	struct archive_entry *en;
+	pkg_file_t *file;
+	void *data;
+	size_t size;
+	const char *ref;  // store object to install instead of data
+	unsigned int slot;
+} job_t;
+
+// Regular file being written. Data is gathered into whole chunks, and
+// zero blocks are skipped, so they are left as holes.
+typedef struct {
+	int fd;
+	char *buf;     // pending data of the chunk at offset
+	size_t len;
+	off_t offset;
+} out_t;
+
+static struct archive *disk;
+static pthread_t writers[EXTRACT_MAX_WRITERS];
+static int nwriters;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static list_t jobs;
+static size_t queued_size;
+static int busy;
+static int finishing;
+// queued and running jobs by path_slot() of their path
+static unsigned int pending[EXTRACT_PATH_SLOTS];
+
+static
+void report_failure(const char *path, const char *strerr) {
+	fprintf(stderr, "Failed to extract %s/%s: %s\n", opt_root, path,
+	        strerr);
+	return;
+}
+
+// FNV-1a hash of path, entries of different paths may share a slot
+static
+unsigned int path_slot(const char *path) {
+	unsigned int h = 2166136261U;
+
+	while (*path) h = (h ^ (unsigned char)*path++) * 16777619U;
+	return h % EXTRACT_PATH_SLOTS;
+}
+
+static
+int pwrite_all(int fd, const char *buf, size_t size, off_t offset) {
+	ssize_t ret;
+
+	while (size) {
+		ret = pwrite(fd, buf, size, offset);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buf += ret;
+		size -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static
+int is_zero(const char *buf, size_t size) {
+	return !buf[0] && !memcmp(buf, buf + 1, size - 1);
+}
+
+static
+int out_data(out_t *out, const char *buf, size_t size, off_t offset) {
+	if (!size) return 0;
+	return pwrite_all(out->fd, buf, size, offset);
+}
+
+// Writes size bytes of buf at offset, leaving out zero blocks.
+static
+int out_write(out_t *out, const char *buf, size_t size, off_t offset) {
+	size_t start = 0, pos = 0, n;
+
+	while (pos < size) {
+		n = MIN(size - pos, EXTRACT_HOLE_SIZE -
+		                    (offset + pos) % EXTRACT_HOLE_SIZE);
+		if (n == EXTRACT_HOLE_SIZE && is_zero(buf + pos, n)) {
+			if (out_data(out, buf + start, pos - start,
+			             offset + start))
+				return -1;
+			start = pos + n;
+		}
+		pos += n;
+	}
+	return out_data(out, buf + start, size - start, offset + start);
+}
+
+static
+int out_flush(out_t *out) {
+	int ret = out_write(out, out->buf, out->len, out->offset);
+	out->offset += out->len;
+	out->len = 0;
+	return ret;
+}
+
+// Adds data at offset to the file, which is written whole chunks at a
+// time. Tar sparse entries come with increasing offsets.
+static
+int out_put(out_t *out, const char *buf, size_t size, off_t offset) {
+	size_t n;
+
+	if (offset != out->offset + (off_t)out->len) {
+		if (out_flush(out)) return -1;
+		out->offset = offset;
+	}
+	while (size) {
+		n = EXTRACT_CHUNK_SIZE - (out->offset + out->len) %
+		                         EXTRACT_CHUNK_SIZE;
+		if (!out->len && size >= n) {
+			// nothing pending, whole chunks go straight from buf
+			n = size - (size - n) % EXTRACT_CHUNK_SIZE;
+			if (out_write(out, buf, n, out->offset)) return -1;
+			out->offset += n;
+		}
+		else {
+			n = MIN(n, size);
+			memcpy(out->buf + out->len, buf, n);
+			out->len += n;
+			if (!((out->offset + out->len) % EXTRACT_CHUNK_SIZE) &&
+			    out_flush(out))
+				return -1;
+		}
+		buf += n;
+		size -= n;
+	}
+	return 0;
+}
+
+// Writes regular file described by en. Its data is taken from buf, or
+// straight from ar if buf is NULL. Returns 0 on success.
+static
+int write_file(struct archive *ar, struct archive_entry *en,
+               const void *buf, size_t size) {
+	const char *path = archive_entry_pathname(en);
+	off_t fsize = archive_entry_size(en);
+	const void *block;
+	off_t offset;
+	out_t out;
+	int ret;
+
+	if (unlink(path) && errno != ENOENT && errno != EISDIR) goto failed;
+	out.fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+	              O_CLOEXEC, 0600);
+	if (out.fd < 0 && errno == ENOENT) {
+		make_parents(path);
+		out.fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+		              O_CLOEXEC, 0600);
+	}
+	if (out.fd < 0) goto failed;
+
+	if (fsize < EXTRACT_HOLE_SIZE && buf) {
+		ldconfig_check_data(path, buf, size);
+		if (write_all(out.fd, buf, size)) goto failed_fd;
+		goto written;
+	}
+
+	out.buf = NULL;
+	out.len = 0;
+	out.offset = 0;
+
+	if (buf) {
+		ldconfig_check_data(path, buf, size);
+		if (out_write(&out, buf, size, 0)) goto failed_fd;
+	}
+	else {
+		out.buf = fmalloc(EXTRACT_CHUNK_SIZE);
+		while ((ret = archive_read_data_block(ar, &block, &size,
+		                                      &offset)) == ARCHIVE_OK) {
+			if (!offset) ldconfig_check_data(path, block, size);
+			if (out_put(&out, block, size, offset)) {
+				free(out.buf);
+				goto failed_fd;
+			}
+		}
+		if (ret != ARCHIVE_EOF) {
+			report_failure(path, archive_error_string(ar));
+			free(out.buf);
+			close(out.fd);
+			return -1;
+		}
+		ret = out_flush(&out);
+		free(out.buf);
+		if (ret) goto failed_fd;
+	}
+	// the holes at the end
+	if (ftruncate(out.fd, fsize)) goto failed_fd;
+
+written:
+	if (fchown(out.fd, archive_entry_uid(en), archive_entry_gid(en)) ||
+	    fchmod(out.fd, archive_entry_mode(en) & 07777))
+		goto failed_fd;
+	if (opt_sync == PKG_SYNC_FULL && fsync(out.fd)) goto failed_fd;
+	if (close(out.fd)) goto failed;
+	return 0;
+failed_fd:
+	close(out.fd);
+failed:
+	report_failure(path, strerror(errno));
+	return -1;
+}
+
+// Installs file en from the store object ref, and records the reference
+// unless the file was rejected and installed under another path.
+static
+int place_file(const char *ref, struct archive_entry *en, pkg_file_t *file) {
+	const char *path = archive_entry_pathname(en);
+
+	if (store_place(ref, en)) {
+		report_failure(path, strerror(errno));
+		return -1;
+	}
+	if (!strcmp(path, file->path)) {
+		free(file->ref);
+		file->ref = strdup(ref);
+	}
+	ldconfig_check_file(path, path);
+	return 0;
+}
+
+// the same as write_file(), but the data goes through the store
+static
+int store_file(struct archive *ar, struct archive_entry *en, pkg_file_t *file,
+               const void *buf, size_t size) {
+	char *ref;
+	int ret;
+
+	ref = store_put(ar, en, buf, size);
+	if (!ref) {
+		report_failure(archive_entry_pathname(en),
+		               ar && errno == EIO ? archive_error_string(ar) :
+		                                    strerror(errno));
+		return -1;
+	}
+	ret = place_file(ref, en, file);
+	free(ref);
+	return ret;
+}
+
+static
+void run_job(job_t *job) {
+	if (job->ref)
+		place_file(job->ref, job->en, job->file);
+	else if (opt_store)
+		store_file(NULL, job->en, job->file, job->data, job->size);
+	else
+		write_file(NULL, job->en, job->data, job->size);
+	return;
+}
+
+static
+void *writer(void *unused) {
+	job_t *job;
+
+	pthread_mutex_lock(&lock);
+	while (1) {
+		while (!jobs.size && !finishing)
+			pthread_cond_wait(&job_ready, &lock);
+		if (!jobs.size) break;
+
+		job = jobs.head->next->data;
+		list_delete(&jobs, jobs.head->next);
+		busy++;
+		pthread_mutex_unlock(&lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&lock);
+		busy--;
+		queued_size -= job->size;
+		pending[job->slot]--;
+		pthread_cond_broadcast(&job_done);
+		archive_entry_free(job->en);
+		free(job->data);
+		free(job);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+// waits until the writers have no more than size bytes of data pending
+static
+void wait_writers(size_t size) {
+	pthread_mutex_lock(&lock);
+	while ((jobs.size || busy) && queued_size > size)
+		pthread_cond_wait(&job_done, &lock);
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+static
+void drain_writers(void) {
+	pthread_mutex_lock(&lock);
+	while (jobs.size || busy)
+		pthread_cond_wait(&job_done, &lock);
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+// Waits until the writers are done with the files of path, so entries
+// of the same path end up on the disk in archive order.
+static
+void wait_path(const char *path) {
+	unsigned int slot = path_slot(path);
+
+	pthread_mutex_lock(&lock);
+	while (pending[slot])
+		pthread_cond_wait(&job_done, &lock);
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+static
+void queue_job(job_t *job, struct archive_entry *en) {
+	job->en = archive_entry_clone(en);
+	if (!job->en) die("archive_entry_clone");
+	job->slot = path_slot(archive_entry_pathname(en));
+
+	// bounded read ahead, the reader blocks while writers catch up
+	wait_writers(EXTRACT_QUEUE_SIZE - job->size);
+
+	pthread_mutex_lock(&lock);
+	queued_size += job->size;
+	pending[job->slot]++;
+	list_append(&jobs, job);
+	pthread_cond_signal(&job_ready);
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+static
+void queue_file(struct archive *ar, struct archive_entry *en,
+                pkg_file_t *file, const char *ref) {
+	job_t *job;
+	size_t size = ref ? 0 : archive_entry_size(en);
+	ssize_t ret;
+
+	job = fmalloc(sizeof(job_t));
+	job->file = file;
+	job->ref = ref;
+	job->size = size;
+	job->data = NULL;
+	if (!ref) {
+		job->data = fmalloc(size ? size : 1);
+		ret = archive_read_data(ar, job->data, size);
+		if (ret < 0 || (size_t)ret != size) {
+			report_failure(archive_entry_pathname(en),
+			               ret < 0 ? archive_error_string(ar) :
+			                         "Truncated archive entry");
+			free(job->data);
+			free(job);
+			return;
+		}
+	}
+	queue_job(job, en);
+	return;
+}
+
+void extract_begin(void) {
+	long ncpus;
+
+	disk = archive_write_disk_new();
+	if (!disk) die("archive_write_disk_new");
+	archive_write_disk_set_options(disk, EXTRACT_FLAGS);
+	archive_write_disk_set_standard_lookup(disk);
+
+	list_init(&jobs);
+	queued_size = 0;
+	busy = 0;
+	finishing = 0;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nwriters = MAX(1, MIN(ncpus, EXTRACT_MAX_WRITERS));
+	for (int i = 0; i < nwriters; i++) {
+		if (pthread_create(&writers[i], NULL, writer, NULL)) {
+			nwriters = i;
+			break;
+		}
+	}
+	return;
+}
+
+// Extracts archive entry en of package file file. Regular files go to
+// the writers, everything else is created here once the writers are done
+// with whatever it could depend on: hard links need their targets to be
+// fully written. Directories are created right away, and so always
+// precede the files which are queued later. An entry whose path is still
+// being written waits for it. Returns negative value on failure.
+int extract_entry(struct archive *ar, struct archive_entry *en,
+                  pkg_file_t *file) {
+	mode_t mode = archive_entry_mode(en);
+	const char *strerr, *ref;
+	int err;
+
+	if (nwriters) wait_path(archive_entry_pathname(en));
+	if (S_ISREG(mode) && !archive_entry_hardlink(en)) {
+		// owned by the user and group names, if they exist here, as
+		// disk does it for the rest. Its lookup cache isn't thread
+		// safe, so that's not left to the writers.
+		archive_entry_set_uid(en, archive_write_disk_uid(disk,
+		                      archive_entry_uname(en),
+		                      archive_entry_uid(en)));
+		archive_entry_set_gid(en, archive_write_disk_gid(disk,
+		                      archive_entry_gname(en),
+		                      archive_entry_gid(en)));
+		// the data is already in the store, nothing to read
+		if (opt_store && (ref = store_lookup(file->path))) {
+			if (!nwriters) return place_file(ref, en, file);
+			queue_file(ar, en, file, ref);
+			return 0;
+		}
+		if (nwriters && archive_entry_size(en) <= EXTRACT_INLINE_SIZE) {
+			queue_file(ar, en, file, NULL);
+			return 0;
+		}
+		if (opt_store) return store_file(ar, en, file, NULL, 0);
+		return write_file(ar, en, NULL, 0);
+	}
+
+	if (archive_entry_hardlink(en)) drain_writers();
+
+	if ((err = archive_write_header(disk, en)) == ARCHIVE_OK)
+		err = archive_write_finish_entry(disk);
+	// links to shared objects count as well
+	if (err >= 0 && (archive_entry_hardlink(en) || S_ISLNK(mode)))
+		ldconfig_check_file(archive_entry_pathname(en),
+		                    archive_entry_pathname(en));
+	if (err < 0) {
+		strerr = "Operation not permitted";
+		// XXX: investigate why libarchive sets EEXIST where EPERM
+		//      expected
+		if (archive_errno(disk) != EEXIST)
+			strerr = archive_error_string(disk);
+		report_failure(archive_entry_pathname(en), strerr);
+	}
+	return err;
+}
+
+void extract_end(void) {
+	pthread_mutex_lock(&lock);
+	finishing = 1;
+	pthread_cond_broadcast(&job_ready);
+	pthread_mutex_unlock(&lock);
+
+	for (int i = 0; i < nwriters; i++)
+		pthread_join(writers[i], NULL);
+	list_free(&jobs);
+
+	// directories permissions are fixed up there, when all files
+	// are in place
+	archive_write_finish(disk);
+	return;
+}
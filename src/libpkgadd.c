@@ -27,6 +27,8 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <ftw.h>
 #include <unistd.h>
 #include <regex.h>
 #include <sys/param.h>
@@ -35,7 +37,11 @@
 #include <pkgutils/pkgutils.h>
 
 #define PKG_REJECT_DIR  LOCALSTATEDIR"/lib/pkg/rejected/"
+#define PKG_STAGE_DIR   LOCALSTATEDIR"/lib/pkg/stage.XXXXXX"
 #define PKG_ADD_CONFIG  SYSCONFDIR"/pkgadd.conf"
+// what may exist in the root to bootstrap, relative to it
+#define PKG_DB_DIR      "."LOCALSTATEDIR"/lib/pkg"
+#define PKG_CACHE_DIR   "."LOCALSTATEDIR"/cache/pkg"
 
 static
 list_t config_rules;
@@ -229,9 +235,9 @@ int adjust_with_fs(pkg_desc_t *pkg) {
 	return 0;
 }
 
-static
-void old_reference(void **ai, void **bj, void *arg) {
-	pkg_file_t *old_pkgfile = (*(list_entry_t**)ai)->data;
+static inline
+void old_reference(path_key_t *ai, path_key_t *bj, void *arg) {
+	pkg_file_t *old_pkgfile = ai->entry->data;
 
 	old_pkgfile->conflict = CONFLICT_REF;
 
@@ -239,10 +245,10 @@ void old_reference(void **ai, void **bj, void *arg) {
 	return;
 }
 
-static
-void self_conflict(void **ai, void **bj, void *arg) {
-	pkg_file_t *new_pkgfile = (*(list_entry_t**)ai)->data;
-	pkg_file_t *old_pkgfile = (*(list_entry_t**)bj)->data;
+static inline
+void self_conflict(path_key_t *ai, path_key_t *bj, void *arg) {
+	pkg_file_t *new_pkgfile = ai->entry->data;
+	pkg_file_t *old_pkgfile = bj->entry->data;
 
 	new_pkgfile->conflict = CONFLICT_SELF;
 	old_pkgfile->conflict = CONFLICT_SELF;
@@ -251,10 +257,10 @@ void self_conflict(void **ai, void **bj, void *arg) {
 	return;
 }
 
-static
-void db_conflict(void **ai, void **bj, void *arg) {
-	pkg_file_t *new_pkgfile = (*(list_entry_t**)ai)->data;
-	pkg_file_t *db_pkgfile = (*(list_entry_t**)bj)->data;
+static inline
+void db_conflict(path_key_t *ai, path_key_t *bj, void *arg) {
+	pkg_file_t *new_pkgfile = ai->entry->data;
+	pkg_file_t *db_pkgfile = bj->entry->data;
 
 	// directories can't conflict. sanity tests (e.g. new file is not a
 	// dir, but db file is) made while finding fs conflicts, not here.
@@ -266,9 +272,16 @@ void db_conflict(void **ai, void **bj, void *arg) {
 	return;
 }
 
+DEFINE_MERGE_JOIN(join_old_references, path_key_t, path_key_compare,
+                  old_reference)
+DEFINE_MERGE_JOIN(join_self_conflicts, path_key_t, path_key_compare,
+                  self_conflict)
+DEFINE_MERGE_JOIN(join_db_conflicts, path_key_t, path_key_compare,
+                  db_conflict)
+
 static
 void adjust_with_db(pkg_desc_t *new_pkg, pkg_desc_t *old_pkg) {
-	void **dbfiles, **newfiles, **oldfiles;
+	path_key_t *dbfiles, *newfiles, *oldfiles;
 	size_t dbsize = 0;
 	size_t cnt;
 
@@ -279,54 +292,43 @@ void adjust_with_db(pkg_desc_t *new_pkg, pkg_desc_t *old_pkg) {
 	}
 	
 	// creating dbfiles sorted array
-	dbfiles = fmalloc(dbsize * sizeof(void *));
+	dbfiles = fmalloc((dbsize ? dbsize : 1) * sizeof(path_key_t));
 	cnt = 0;
 	list_for_each(_pkg, &pkg_db) {
 		pkg_desc_t *pkg = _pkg->data;
 		if (pkg == old_pkg) continue;
-		list_for_each(_file, &pkg->files) {
-			dbfiles[cnt] = _file;
-			cnt++;
-		}
+		cnt += path_keys_add(dbfiles + cnt, &pkg->files);
 	}
-	qsort(dbfiles, dbsize, sizeof(void *), file_cmp);
+	path_keys_sort(dbfiles, dbsize);
 
 	// creating newfiles sorted array
-	newfiles = fmalloc(new_pkg->files.size * sizeof(void *));
-	cnt = 0;
-	list_for_each(_file, &new_pkg->files) {
-		newfiles[cnt] = _file;
-		cnt++;
-	}
-	qsort(newfiles, new_pkg->files.size, sizeof(void *), file_cmp);
+	newfiles = fmalloc((new_pkg->files.size ? new_pkg->files.size : 1) *
+	                   sizeof(path_key_t));
+	path_keys_add(newfiles, &new_pkg->files);
+	path_keys_sort(newfiles, new_pkg->files.size);
 
 	// intersections between dbfiles and newfiles are db conflicts
-	intersect_uniq(newfiles, new_pkg->files.size, dbfiles, dbsize,
-	               file_cmp, db_conflict, NULL, NULL);
+	join_db_conflicts(newfiles, new_pkg->files.size, dbfiles, dbsize, NULL);
 	
 	if (old_pkg) {
 		// creating oldfiles sorted array
-		oldfiles = fmalloc(old_pkg->files.size * sizeof(void *));
-		cnt = 0;
-		list_for_each(_file, &old_pkg->files) {
-			oldfiles[cnt] = _file;
-			cnt++;
-		}
-		qsort(oldfiles, old_pkg->files.size, sizeof(void *), file_cmp);
+		oldfiles = fmalloc((old_pkg->files.size ?
+		                    old_pkg->files.size : 1) *
+		                   sizeof(path_key_t));
+		path_keys_add(oldfiles, &old_pkg->files);
+		path_keys_sort(oldfiles, old_pkg->files.size);
 		
 		// intersections between newfiles and oldfiles are self
 		// conflicts to newfiles. intersected oldfiles are references
 		// which should be marked and not removed from filesystem
 		// later, as they'll overwritten by newfiles
-		intersect_uniq(newfiles, new_pkg->files.size,
-		               oldfiles, old_pkg->files.size,
-		               file_cmp, self_conflict, NULL, NULL);
+		join_self_conflicts(newfiles, new_pkg->files.size,
+		                    oldfiles, old_pkg->files.size, NULL);
 		
 		// intersections between oldfiles and dbfiles are references
 		// which must be removed from oldfiles later
-		intersect_uniq(oldfiles, old_pkg->files.size,
-		               dbfiles, dbsize,
-		               file_cmp, old_reference, NULL, NULL);
+		join_old_references(oldfiles, old_pkg->files.size,
+		                    dbfiles, dbsize, NULL);
 		
 		free(oldfiles);
 	}
@@ -350,45 +352,73 @@ int adjust_with_config(const char *path, rule_type_t type) {
 	return ret;
 }
 
+// Decides where the package file with archive path cpath goes. Returns
+// NULL if it should not be installed at all, otherwise cpath itself or
+// the rejected location, stored in buf.
 static
-void extract_files(struct archive *ar, struct archive_entry *en,
-                   void *___file, void *unused) {
-	list_entry_t **__file = ___file;
-	list_entry_t *_file = *__file;
-	pkg_file_t *file = _file->next->data;
-	*__file = _file->next;
-	
-	char path[MAXPATHLEN+1];
-	const char *cpath = archive_entry_pathname(en);
-	mode_t mode = archive_entry_mode(en);
-
-	if (!adjust_with_config(cpath, INSTALL)) return;
+const char *install_path(pkg_file_t *file, const char *cpath, char *buf) {
+	if (!adjust_with_config(cpath, INSTALL)) return NULL;
 
 	if (file->conflict != CONFLICT_NONE &&
 	                   !adjust_with_config(cpath, UPGRADE)) {
-		strcpy(path, PKG_REJECT_DIR);
-		strcat(path, cpath);
-		archive_entry_set_pathname(en, path);
-		if (!S_ISDIR(mode)) {
+		strcpy(buf, PKG_REJECT_DIR);
+		strcat(buf, cpath);
+		if (!S_ISDIR(file->mode)) {
 			fprintf(stderr, "rejecting %s\n", cpath);
-			dbg("to %s/%s\n", opt_root, path);
+			dbg("to %s/%s\n", opt_root, buf);
 		}
-		else dbg("rejecting %s to %s/%s\n", cpath, opt_root, path);
-	}
-	else dbg("installing %s/%s\n", opt_root, cpath);
-
-	int err;
-	if ((err = archive_read_extract(ar, en, ARCHIVE_EXTRACT_OWNER |
-	                                        ARCHIVE_EXTRACT_PERM |
-	                                        ARCHIVE_EXTRACT_UNLINK)) < 0) {
-		const char *strerr = "Operation not permitted";
-		err = archive_errno(ar);
-		// XXX: investigate why libarchive sets EEXIST where EPERM
-		//      expected
-		if (err != EEXIST) strerr = archive_error_string(ar);
-		fprintf(stderr, "Failed to extract %s/%s: %s\n", opt_root,
-		        archive_entry_pathname(en), strerr);
+		else dbg("rejecting %s to %s/%s\n", cpath, opt_root, buf);
+		return buf;
 	}
+	dbg("installing %s/%s\n", opt_root, cpath);
+	return cpath;
+}
+
+// Advances cursor over the package files listed earlier, to the one of
+// archive entry en. Returns NULL if the listing doesn't match the
+// archive, which only happens with a broken embedded manifest. The
+// conflict checks went by the listing, so the entry must have the same
+// type and ownership as well as the path.
+static
+pkg_file_t *next_file(list_entry_t **cursor, struct archive_entry *en) {
+	const char *cpath = archive_entry_pathname(en);
+	mode_t mode = archive_entry_mode(en);
+	pkg_file_t *file;
+	size_t len;
+
+	if (!(*cursor)->next->next) goto mismatch;
+	*cursor = (*cursor)->next;
+	file = (*cursor)->data;
+	len = strlen(file->path);
+	if (strncmp(cpath, file->path, len)) goto mismatch;
+	if (cpath[len] && (cpath[len] != '/' || cpath[len+1] ||
+	                   !S_ISDIR(mode)))
+		goto mismatch;
+	// file->mode may be the one of a symlink to the directory by now
+	if ((mode & S_IFMT) == file->type &&
+	    (mode & ~S_IFMT) == (file->mode & ~S_IFMT) &&
+	    archive_entry_uid(en) == file->uid &&
+	    archive_entry_gid(en) == file->gid)
+		return file;
+mismatch:
+	fprintf(stderr, "Package listing does not match %s, skipping it\n",
+	        cpath);
+	return NULL;
+}
+
+static
+void extract_files(struct archive *ar, struct archive_entry *en,
+                   void *cursor, void *unused) {
+	pkg_file_t *file = next_file(cursor, en);
+	char path[MAXPATHLEN+1];
+	const char *cpath = archive_entry_pathname(en);
+	const char *target;
+
+	if (!file) return;
+	if (!(target = install_path(file, cpath, path))) return;
+	if (target != cpath) archive_entry_set_pathname(en, target);
+
+	extract_entry(ar, en, file);
 	return;
 }
 
@@ -411,7 +441,13 @@ void list_files(struct archive *ar, struct archive_entry *en, void *_pkg,
 	pkg_file->pkg = pkg;
 	pkg_file->conflict = CONFLICT_NONE;
 	pkg_file->path = path;
+	pkg_file->ref  = NULL;
+	// hard links share the data of the file they link to
+	pkg_file->size = S_ISREG(mode) && !archive_entry_hardlink(en) ?
+	                 archive_entry_size(en) : 0;
 	pkg_file->mode = mode;
+	// mode may change to how the file is stored on the file system
+	pkg_file->type = mode & S_IFMT;
 	pkg_file->uid  = archive_entry_uid(en);
 	pkg_file->gid  = archive_entry_gid(en);
 	list_append(&pkg->files, pkg_file);
@@ -421,30 +457,29 @@ void list_files(struct archive *ar, struct archive_entry *en, void *_pkg,
 
 static
 void del_old_pkg(pkg_desc_t *old_pkg) {
-	list_for_each_r(_file, &old_pkg->files) {
+	unlink_begin(".");
+	list_for_each(_file, &old_pkg->files) {
 		pkg_file_t *file = _file->data;
-		if (!file->conflict) {
-			if (remove(file->path)) {
-				fprintf(stderr, "Can't remove %s/%s: %s\n",
-					opt_root, file->path, strerror(errno));
-			}
-		}
-		_file = _file->next;
-		list_delete(&old_pkg->files, _file->prev);
-		free(file->path);
-		free(file);
+		if (!file->conflict) unlink_file(file);
 	}
-	list_free(&old_pkg->files);
+	unlink_end();
 
 	list_for_each(_pkg, &pkg_db) {
 		if (_pkg->data != old_pkg) continue;
 		list_delete(&pkg_db, _pkg);
 		break;
 	}
+	pkg_free_desc(old_pkg);
+	return;
+}
 
-	free(old_pkg->name);
-	free(old_pkg->version);
-	free(old_pkg);
+// Removes old_pkg which is being replaced, keeping its files in the
+// rollback cache if it's enabled.
+static
+void replace_old_pkg(pkg_desc_t *old_pkg) {
+	if (opt_rollback) rollback_save(old_pkg);
+	del_old_pkg(old_pkg);
+	if (opt_rollback) rollback_evict();
 	return;
 }
 
@@ -456,8 +491,7 @@ void cleanup_pkg(pkg_desc_t *pkg, int remove) {
 			if (remove) {
 				_file = _file->prev;
 				list_delete(&pkg->files, _file->next);
-				free(file->path);
-				free(file);
+				pkg_free_file(file);
 			}
 			else file->conflict = CONFLICT_NONE;
 		}
@@ -474,13 +508,34 @@ void cleanup_pkg_db(void) {
 	return;
 }
 
+// Finds and reports conflicts of pkg which is about to replace old_pkg.
+// Returns found conflicts, and sets *blocked if the installation can't
+// proceed with the given options.
+static
+int find_conflicts(pkg_desc_t *pkg, pkg_desc_t *old_pkg, int opts,
+                   int *blocked) {
+	int found_conflicts;
+
+	adjust_with_db(pkg, old_pkg);
+	adjust_with_fs(pkg);
+	found_conflicts = report_conflicts(pkg);
+
+	*blocked = (found_conflicts & CONFLICT_PERM &&
+	            !(opts & PKG_ADD_FORCE_PERM)) ||
+	           (found_conflicts & ~CONFLICT_PERM && !(opts & PKG_ADD_FORCE));
+	if (*blocked) cleanup_pkg_db();
+	return found_conflicts;
+}
+
 // Returns found conflicts, -1 on other errors, 0 on success
 int pkg_add(const char *pkg_path, int opts) {
 	FILE *pkgf = NULL, *curdir = NULL;
 	pkg_desc_t *pkg = NULL;
 	pkg_desc_t *old_pkg;
 	int found_conflicts = -1;
+	int blocked;
 	read_config();
+	ldconfig_init();
 	
 	pkgf = fopen(pkg_path, "r");
 	if (!pkgf) {
@@ -488,6 +543,7 @@ int pkg_add(const char *pkg_path, int opts) {
 		        strerror(errno));
 		goto cleanup;
 	}
+	manifest_init();
 	curdir = fopen(".", "r");
 	if (!curdir) die("Failed to obtain current directory");
 	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
@@ -501,50 +557,330 @@ int pkg_add(const char *pkg_path, int opts) {
 		pkg->version = NULL;
 		goto cleanup;
 	}
-	if (do_archive(pkgf, list_files, pkg, NULL)) abort();
-
-	old_pkg = pkg_find_pkg(pkg->name);
-	adjust_with_db(pkg, old_pkg);
-	adjust_with_fs(pkg);
-	found_conflicts = report_conflicts(pkg);
-	
-	if (found_conflicts & CONFLICT_PERM && !(opts & PKG_ADD_FORCE_PERM)) {
-		cleanup_pkg_db();
-		goto cleanup;
-	}
-	if (found_conflicts & ~CONFLICT_PERM && !(opts & PKG_ADD_FORCE)) {
-		cleanup_pkg_db();
+	if (do_manifest(pkgf, list_files, pkg, NULL)) {
+		fprintf(stderr, "Failed to read package %s\n", pkg_path);
 		goto cleanup;
 	}
 
-	if (old_pkg) del_old_pkg(old_pkg);
+	old_pkg = pkg_find_pkg(pkg->name);
+	found_conflicts = find_conflicts(pkg, old_pkg, opts, &blocked);
+	if (blocked) goto cleanup;
+
+	if (old_pkg) replace_old_pkg(old_pkg);
 	cleanup_pkg_db();
 	list_append(&pkg_db, pkg);
-	pkg_commit_db();
 
 	list_entry_t *tmp = pkg->files.head;
+	if (opt_store) store_begin(pkgf, pkg_path);
+	extract_begin();
 	do_archive(pkgf, extract_files, &tmp, NULL);
+	extract_end();
+	if (opt_store) store_end(pkg);
 
 	cleanup_pkg(pkg, 0); // clean up conflicts flags
+	pkg_update_db();
 
-	run_ldconfig();
+	pkg = NULL;
+cleanup:
+	if (pkg) pkg_free_desc(pkg);
+	if (pkgf) fclose(pkgf);
+	if (curdir) {
+		if (fchdir(fileno(curdir)) < 0)
+			die("Can't go back to CWD");
+		fclose(curdir);
+	}
+	cleanup_config();
+	return found_conflicts;
+}
+
+// Collects the file list while extracting files into the staging
+// directory. Directories are not staged, they are created in place
+// once the conflicts are known.
+static
+void stage_files(struct archive *ar, struct archive_entry *en, void *_pkg,
+                 void *stage) {
+	pkg_desc_t *pkg = _pkg;
+	pkg_file_t *file;
+	char path[MAXPATHLEN+1];
+
+	list_files(ar, en, pkg, NULL);
+	file = pkg->files.tail->prev->data;
+	if (S_ISDIR(file->mode)) return;
+
+	snprintf(path, sizeof(path), "%s/%s", (char *)stage, file->path);
+	archive_entry_set_pathname(en, path);
+	if (archive_entry_hardlink(en)) {
+		snprintf(path, sizeof(path), "%s/%s", (char *)stage,
+		         archive_entry_hardlink(en));
+		archive_entry_set_hardlink(en, path);
+	}
+	extract_entry(ar, en, file);
+	return;
+}
+
+// Moves a staged file, or one kept for rollback, into place the same way
+// libarchive replaces existing files. Returns 0 on success.
+static
+int move_staged(const char *from, const char *to) {
+	struct stat st;
+	int src, dst, err;
+
+	if (!rename(from, to)) return 0;
+	if (errno == ENOENT) {
+		make_parents(to);
+		if (!rename(from, to)) return 0;
+	}
+	// an empty directory is in the way
+	if ((errno == EISDIR || errno == ENOTEMPTY || errno == EEXIST) &&
+	    !rmdir(to) && !rename(from, to))
+		return 0;
+	if (errno != EXDEV) return -1;
+
+	// the root spans several file systems, copy then
+	if (lstat(from, &st) || (unlink(to) && errno != ENOENT)) return -1;
+	if (S_ISLNK(st.st_mode)) {
+		char target[MAXPATHLEN+1];
+		ssize_t len = readlink(from, target, MAXPATHLEN);
+		if (len < 0) return -1;
+		target[len] = '\0';
+		if (symlink(target, to)) return -1;
+		return lchown(to, st.st_uid, st.st_gid);
+	}
+	if (!S_ISREG(st.st_mode)) {
+		if (mknod(to, st.st_mode, st.st_rdev)) return -1;
+		return lchown(to, st.st_uid, st.st_gid) ||
+		       chmod(to, st.st_mode & 07777);
+	}
+
+	src = open(from, O_RDONLY | O_CLOEXEC);
+	if (src < 0) return -1;
+	dst = open(to, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	           0600);
+	if (dst < 0 || copy_fd(src, dst) ||
+	    fchown(dst, st.st_uid, st.st_gid) ||
+	    fchmod(dst, st.st_mode & 07777) ||
+	    (opt_sync == PKG_SYNC_FULL && fsync(dst))) {
+		err = errno;
+		close(src);
+		if (dst >= 0) close(dst);
+		errno = err;
+		return -1;
+	}
+	close(src);
+	return close(dst);
+}
+
+// Puts staged files in place and creates directories, in the archive
+// order. Directory permissions are set when all files are there.
+static
+void commit_staged(pkg_desc_t *pkg, const char *stage) {
+	char staged[MAXPATHLEN+1], buf[MAXPATHLEN+1];
+	const char *target;
+	struct archive_entry *en;
+	struct stat st;
+
+	extract_begin();
+	list_for_each(_file, &pkg->files) {
+		pkg_file_t *file = _file->data;
+
+		target = install_path(file, file->path, buf);
+		if (!target) continue;
+
+		// staged directories are only parents of staged files, and
+		// those which failed to stage are missing. Directories which
+		// are symlinks on the file system have the link mode by now.
+		if (!S_ISDIR(file->type)) {
+			snprintf(staged, sizeof(staged), "%s/%s", stage,
+			         file->path);
+			if (lstat(staged, &st) || S_ISDIR(st.st_mode))
+				fprintf(stderr, "Failed to extract %s/%s: "
+				        "not staged\n", opt_root, target);
+			else if (move_staged(staged, target))
+				fprintf(stderr, "Failed to extract %s/%s: %s\n",
+				        opt_root, target, strerror(errno));
+			else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+				ldconfig_check_file(target, target);
+			continue;
+		}
+
+		// directories may be stored as symlinks to directories on the
+		// file system
+		en = archive_entry_new();
+		if (!en) die("archive_entry_new");
+		archive_entry_set_pathname(en, target);
+		archive_entry_set_mode(en, S_IFDIR | (file->mode & 07777));
+		archive_entry_set_uid(en, file->uid);
+		archive_entry_set_gid(en, file->gid);
+		extract_entry(NULL, en, file);
+		archive_entry_free(en);
+	}
+	extract_end();
+	return;
+}
+
+// Installs a package read in one pass from fd, which needn't be seekable.
+// The package is extracted into a staging directory under the root while
+// being read, and moved into place when conflicts are known. pkg_name is
+// the package file name. Returns the same as pkg_add().
+int pkg_add_fd(int fd, const char *pkg_name, int opts) {
+	FILE *curdir = NULL;
+	pkg_desc_t *pkg = NULL;
+	pkg_desc_t *old_pkg;
+	char stage[] = PKG_STAGE_DIR;
+	char *store = opt_store;
+	int found_conflicts = -1;
+	int blocked, err;
+	read_config();
+	ldconfig_init();
+
+	curdir = fopen(".", "r");
+	if (!curdir) die("Failed to obtain current directory");
+	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
+		die("Can't chdir to root directory");
+
+	pkg = fmalloc(sizeof(pkg_desc_t));
+	list_init(&pkg->files);
+	if (pkg_make_desc(pkg_name, pkg)) {
+		fprintf(stderr, "'%s' is not a valid package name\n", pkg_name);
+		pkg->name = NULL;
+		pkg->version = NULL;
+		goto cleanup;
+	}
+
+	// the staging directory is relative to the root, like package files
+	if (!mkdtemp(stage + 1)) die(stage + 1);
+
+	// store index is keyed by the archive file, which is not there
+	opt_store = NULL;
+	extract_begin();
+	err = do_archive_fd(fd, stage_files, pkg, stage + 1);
+	extract_end();
+	opt_store = store;
+	if (err) {
+		fprintf(stderr, "Failed to read package %s\n", pkg_name);
+		goto cleanup_stage;
+	}
+
+	old_pkg = pkg_find_pkg(pkg->name);
+	found_conflicts = find_conflicts(pkg, old_pkg, opts, &blocked);
+	if (blocked) goto cleanup_stage;
+
+	if (old_pkg) replace_old_pkg(old_pkg);
+	cleanup_pkg_db();
+	list_append(&pkg_db, pkg);
+
+	commit_staged(pkg, stage + 1);
+
+	cleanup_pkg(pkg, 0); // clean up conflicts flags
+	pkg_update_db();
 
 	pkg = NULL;
+cleanup_stage:
+	remove_tree(stage + 1);
 cleanup:
-	if (pkg) {
-		list_for_each(_file, &pkg->files) {
-			pkg_file_t *file = _file->data;
-			_file = _file->prev;
-			list_delete(&pkg->files, _file->next);
-			free(file->path);
-			free(file);
+	if (pkg) pkg_free_desc(pkg);
+	if (curdir) {
+		if (fchdir(fileno(curdir)) < 0)
+			die("Can't go back to CWD");
+		fclose(curdir);
+	}
+	cleanup_config();
+	return found_conflicts;
+}
+
+// Restores the version of package name replaced by the last upgrade from
+// the rollback cache, the current version is removed. Returns found
+// conflicts, -1 on other errors, 0 on success.
+int pkg_rollback(const char *name, int opts) {
+	FILE *curdir = NULL;
+	pkg_desc_t *pkg = NULL;
+	pkg_desc_t *cur_pkg;
+	char dir[MAXPATHLEN+1], snapshot[MAXPATHLEN+1];
+	struct stat st;
+	int found_conflicts = -1;
+	read_config();
+	ldconfig_init();
+
+	curdir = fopen(".", "r");
+	if (!curdir) die("Failed to obtain current directory");
+	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
+		die("Can't chdir to root directory");
+
+	pkg = rollback_load(name, dir);
+	if (!pkg) {
+		fprintf(stderr, "No rollback for package \"%s\"\n", name);
+		goto cleanup;
+	}
+
+	// only files taken over by other packages since then conflict, the
+	// ones which are not in the snapshot are still installed
+	cur_pkg = pkg_find_pkg(pkg->name);
+	adjust_with_db(pkg, cur_pkg);
+	list_for_each(_file, &pkg->files) {
+		pkg_file_t *file = _file->data;
+		if (rollback_path(snapshot, dir, file->path)) {
+			fprintf(stderr, "Can't restore %s/%s: %s\n", opt_root,
+			        file->path, strerror(errno));
+			cleanup_pkg_db();
+			goto cleanup;
 		}
-		list_free(&pkg->files);
-		free(pkg->name);
-		free(pkg->version);
-		free(pkg);
+		if (lstat(snapshot, &st)) file->conflict = CONFLICT_NONE;
 	}
-	if (pkgf) fclose(pkgf);
+	found_conflicts = report_conflicts(pkg);
+	if (found_conflicts && !(opts & PKG_ADD_FORCE)) {
+		cleanup_pkg_db();
+		goto cleanup;
+	}
+
+	if (cur_pkg) del_old_pkg(cur_pkg);
+	cleanup_pkg_db();
+
+	list_for_each(_file, &pkg->files) {
+		pkg_file_t *file = _file->data;
+		// the paths fit, that's checked above
+		if (rollback_path(snapshot, dir, file->path) ||
+		    lstat(snapshot, &st))
+			continue;
+
+		dbg("restoring %s/%s\n", opt_root, file->path);
+		if (S_ISDIR(st.st_mode)) {
+			if (mkdir(file->path, 0700) && errno == ENOENT) {
+				make_parents(file->path);
+				mkdir(file->path, 0700);
+			}
+		}
+		else if (move_staged(snapshot, file->path))
+			fprintf(stderr, "Failed to restore %s/%s: %s\n",
+			        opt_root, file->path, strerror(errno));
+		else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+			ldconfig_check_file(file->path, file->path);
+	}
+
+	// directories get their permissions back when files are in place.
+	// The ones stored as symlinks are left alone.
+	list_for_each_r(_file, &pkg->files) {
+		pkg_file_t *file = _file->data;
+		struct stat cur;
+		if (!S_ISDIR(file->mode)) continue;
+
+		if (rollback_path(snapshot, dir, file->path) ||
+		    lstat(snapshot, &st) || lstat(file->path, &cur) ||
+		    !S_ISDIR(cur.st_mode))
+			continue;
+		if (chown(file->path, st.st_uid, st.st_gid) ||
+		    chmod(file->path, st.st_mode & 07777))
+			fprintf(stderr, "Failed to restore %s/%s: %s\n",
+			        opt_root, file->path, strerror(errno));
+	}
+
+	cleanup_pkg(pkg, 0);
+	list_append(&pkg_db, pkg);
+	pkg_update_db();
+	remove_tree(dir);
+
+	pkg = NULL;
+cleanup:
+	if (pkg) pkg_free_desc(pkg);
 	if (curdir) {
 		if (fchdir(fileno(curdir)) < 0)
 			die("Can't go back to CWD");
@@ -553,3 +889,364 @@ cleanup:
 	cleanup_config();
 	return found_conflicts;
 }
+
+typedef struct {
+	list_entry_t *file;
+	size_t order;
+} bootstrap_file_t;
+
+// non-directory found in the root to bootstrap
+static char root_file[MAXPATHLEN+1];
+
+static
+int is_under(const char *path, const char *dir) {
+	size_t len = strlen(dir);
+	return !strncmp(path, dir, len) && (!path[len] || path[len] == '/');
+}
+
+static
+int check_root_file(const char *path, const struct stat *st, int flag,
+                    struct FTW *ftw) {
+	if (is_under(path, PKG_DB_DIR) || is_under(path, PKG_CACHE_DIR))
+		return flag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	if (flag == FTW_D || flag == FTW_DNR) return FTW_CONTINUE;
+	strncpy(root_file, path + 2, MAXPATHLEN);
+	return FTW_STOP;
+}
+
+static
+int bootstrap_cmp(const void *a, const void *b) {
+	const bootstrap_file_t *fa = a, *fb = b;
+	int ret = file_cmp(&fa->file, &fb->file);
+	if (ret) return ret;
+	return fa->order < fb->order ? -1 : fa->order > fb->order;
+}
+
+// Finds conflicts between the packages to bootstrap, in the order they
+// are installed. The same directories in later packages are marked with
+// CONFLICT_SELF, so they are created once, or CONFLICT_PERM if their
+// mode or ownership differ. Files in more than one package are
+// CONFLICT_DB. Returns found conflicts.
+static
+int bootstrap_conflicts(pkg_desc_t **pkgs, size_t npkgs) {
+	bootstrap_file_t *files;
+	pkg_file_t *first, *file;
+	size_t nfiles = 0, i, j;
+	int types = CONFLICT_NONE;
+
+	for (i = 0; i < npkgs; i++) nfiles += pkgs[i]->files.size;
+	files = fmalloc(nfiles * sizeof(bootstrap_file_t) + 1);
+	nfiles = 0;
+	for (i = 0; i < npkgs; i++) {
+		list_for_each(_file, &pkgs[i]->files) {
+			files[nfiles].file = _file;
+			files[nfiles].order = nfiles;
+			nfiles++;
+		}
+	}
+	qsort(files, nfiles, sizeof(bootstrap_file_t), bootstrap_cmp);
+
+	for (i = 0; i < nfiles; i = j) {
+		first = files[i].file->data;
+		for (j = i + 1; j < nfiles; j++) {
+			file = files[j].file->data;
+			if (strcmp(file->path, first->path)) break;
+
+			if (!S_ISDIR(file->mode) || !S_ISDIR(first->mode)) {
+				file->conflict = CONFLICT_DB;
+				printf("%s: %s is in %s too\n", file->pkg->name,
+				       file->path, first->pkg->name);
+			}
+			else if (file->mode != first->mode ||
+			         file->uid != first->uid ||
+			         file->gid != first->gid) {
+				char smode[11], smode2[11];
+				file->conflict = CONFLICT_PERM;
+				printf("%s: %s %d/%d %s, %s has %s %d/%d\n",
+				       file->pkg->name,
+				       mode_string(file->mode, smode),
+				       file->uid, file->gid, file->path,
+				       first->pkg->name,
+				       mode_string(first->mode, smode2),
+				       first->uid, first->gid);
+			}
+			else file->conflict = CONFLICT_SELF;
+			types |= file->conflict;
+		}
+	}
+	types &= ~CONFLICT_SELF;
+
+	free(files);
+	return types;
+}
+
+static
+void bootstrap_files(struct archive *ar, struct archive_entry *en,
+                     void *cursor, void *unused) {
+	pkg_file_t *file = next_file(cursor, en);
+
+	// directories are created by the first package which has them
+	if (!file || (S_ISDIR(file->mode) && file->conflict != CONFLICT_NONE))
+		return;
+	if (!adjust_with_config(archive_entry_pathname(en), INSTALL)) return;
+	dbg("installing %s/%s\n", opt_root, archive_entry_pathname(en));
+	extract_entry(ar, en, file);
+	return;
+}
+
+// Installs packages into the root which has nothing installed yet. The
+// conflicts are only looked for between the packages themselves, without
+// looking at the file system, then all packages are extracted back to
+// back, and the database is updated once. Returns found conflicts, -1 on
+// other errors, 0 on success.
+int pkg_bootstrap(int npkgs, char *pkg_paths[], int opts) {
+	FILE **pkgfs, *curdir = NULL;
+	pkg_desc_t **pkgs;
+	list_entry_t *tmp;
+	int found_conflicts = -1;
+	int i, nopened, nlisted = 0;
+	read_config();
+	ldconfig_init();
+	manifest_init();
+
+	pkgfs = fmalloc(npkgs * sizeof(FILE*) + 1);
+	pkgs = fmalloc(npkgs * sizeof(pkg_desc_t*) + 1);
+	curdir = fopen(".", "r");
+	if (!curdir) die("Failed to obtain current directory");
+
+	// package paths may be relative to the current directory
+	for (nopened = 0; nopened < npkgs; nopened++) {
+		pkgfs[nopened] = fopen(pkg_paths[nopened], "r");
+		if (!pkgfs[nopened]) {
+			fprintf(stderr, "Can't open package %s: %s\n",
+			        pkg_paths[nopened], strerror(errno));
+			goto cleanup;
+		}
+	}
+	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
+		die("Can't chdir to root directory");
+
+	root_file[0] = '\0';
+	nftw(".", check_root_file, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+	if (pkg_db.size || root_file[0]) {
+		fprintf(stderr, "Root %s is not empty%s%s\n",
+		        strcmp(opt_root, "") ? opt_root : "/",
+		        root_file[0] ? ": " : "", root_file);
+		goto cleanup;
+	}
+
+	for (nlisted = 0; nlisted < npkgs; nlisted++) {
+		pkg_desc_t *pkg = fmalloc(sizeof(pkg_desc_t));
+		list_init(&pkg->files);
+		if (pkg_make_desc(pkg_paths[nlisted], pkg)) {
+			fprintf(stderr, "'%s' is not a valid package name\n",
+			        pkg_paths[nlisted]);
+			list_free(&pkg->files);
+			free(pkg);
+			goto cleanup;
+		}
+		if (do_manifest(pkgfs[nlisted], list_files, pkg, NULL)) {
+			fprintf(stderr, "Failed to read package %s\n",
+			        pkg_paths[nlisted]);
+			pkg_free_desc(pkg);
+			goto cleanup;
+		}
+		pkgs[nlisted] = pkg;
+	}
+
+	found_conflicts = bootstrap_conflicts(pkgs, npkgs);
+	if ((found_conflicts & CONFLICT_PERM && !(opts & PKG_ADD_FORCE_PERM)) ||
+	    (found_conflicts & ~CONFLICT_PERM && !(opts & PKG_ADD_FORCE)))
+		goto cleanup;
+
+	extract_begin();
+	for (i = 0; i < npkgs; i++) {
+		tmp = pkgs[i]->files.head;
+		if (opt_store) store_begin(pkgfs[i], pkg_paths[i]);
+		do_archive(pkgfs[i], bootstrap_files, &tmp, NULL);
+		if (opt_store) store_end(pkgs[i]);
+	}
+	extract_end();
+
+	for (i = 0; i < npkgs; i++) {
+		cleanup_pkg(pkgs[i], 0); // clean up conflicts flags
+		list_append(&pkg_db, pkgs[i]);
+	}
+	pkg_update_db();
+
+	nlisted = 0;
+cleanup:
+	for (i = 0; i < nlisted; i++) pkg_free_desc(pkgs[i]);
+	for (i = 0; i < nopened; i++) fclose(pkgfs[i]);
+	free(pkgs);
+	free(pkgfs);
+	if (fchdir(fileno(curdir)) < 0) die("Can't go back to CWD");
+	fclose(curdir);
+	cleanup_config();
+	return found_conflicts;
+}
+
+// state of pkg_extract()
+typedef struct {
+	pkg_desc_t pkg;     // files extracted
+	char **paths;
+	int npaths;
+	list_t links;       // hard links whose targets are not extracted
+} subset_t;
+
+// a hard link to be extracted with the data of its target
+typedef struct {
+	pkg_file_t *file;
+	char *target;
+	int done;
+} subset_link_t;
+
+// Returns nonzero if path is one of the paths asked for
+static
+int subset_has(subset_t *subset, const char *path) {
+	for (int i = 0; i < subset->npaths; i++) {
+		const char *p = subset->paths[i];
+		while (*p == '/') p++;
+		if (!strcmp(p, path)) return 1;
+	}
+	return 0;
+}
+
+static
+void extract_subset(struct archive *ar, struct archive_entry *en,
+                    void *_subset, void *unused) {
+	subset_t *subset = _subset;
+	const char *target = archive_entry_hardlink(en);
+	pkg_file_t *file;
+
+	list_files(ar, en, &subset->pkg, NULL);
+	file = subset->pkg.files.tail->prev->data;
+
+	// the link would point to nothing, its target is extracted under
+	// the link's path later
+	if (target && !subset_has(subset, target)) {
+		subset_link_t *link = fmalloc(sizeof(subset_link_t));
+		link->file = file;
+		link->target = strdup(target);
+		link->done = 0;
+		if (!link->target) die("strdup");
+		list_append(&subset->links, link);
+		return;
+	}
+	extract_entry(ar, en, file);
+	return;
+}
+
+// Extracts target entry en under the paths of the hard links to it. The
+// first one gets the data, the rest are linked to it.
+static
+void extract_link_target(struct archive *ar, struct archive_entry *en,
+                         void *_subset, void *unused) {
+	subset_t *subset = _subset;
+	char *target, *first = NULL;
+
+	// the entry is renamed below
+	target = strdup(archive_entry_pathname(en));
+	if (!target) die("strdup");
+	list_for_each(_link, &subset->links) {
+		subset_link_t *link = _link->data;
+
+		if (link->done || strcmp(link->target, target)) continue;
+		link->done = 1;
+		archive_entry_set_pathname(en, link->file->path);
+		if (!first) {
+			extract_entry(ar, en, link->file);
+			first = strdup(link->file->path);
+			if (!first) die("strdup");
+			continue;
+		}
+		// with a size, the data would be expected again
+		archive_entry_set_hardlink(en, first);
+		archive_entry_set_size(en, 0);
+		extract_entry(ar, en, link->file);
+	}
+	free(first);
+	free(target);
+	return;
+}
+
+// Extracts the files of package pkg_path with the given paths into the
+// root as they are in the package, whether or not it's installed. Hard
+// links whose targets are not asked for get the data of the targets.
+// The database is left alone. Only the parts of a seekable package
+// holding the files are inflated. Returns the number of paths not found
+// in the package, -1 on errors.
+int pkg_extract(const char *pkg_path, char *paths[], int npaths) {
+	FILE *pkgf, *curdir;
+	subset_t subset;
+	char **targets;
+	int ntargets = 0;
+	int missing = 0;
+
+	pkgf = fopen(pkg_path, "r");
+	if (!pkgf) {
+		fprintf(stderr, "Can't open package %s: %s\n", pkg_path,
+		        strerror(errno));
+		return -1;
+	}
+	curdir = fopen(".", "r");
+	if (!curdir) die("Failed to obtain current directory");
+	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
+		die("Can't chdir to root directory");
+
+	list_init(&subset.pkg.files);
+	list_init(&subset.links);
+	subset.paths = paths;
+	subset.npaths = npaths;
+	extract_begin();
+	if (do_archive_paths(pkgf, paths, npaths, extract_subset, &subset,
+	                     NULL))
+		missing = -1;
+
+	targets = fmalloc((subset.links.size + 1) * sizeof(char *));
+	list_for_each(_link, &subset.links) {
+		subset_link_t *link = _link->data;
+		targets[ntargets++] = link->target;
+	}
+	if (ntargets && missing >= 0 &&
+	    do_archive_paths(pkgf, targets, ntargets, extract_link_target,
+	                     &subset, NULL))
+		missing = -1;
+	free(targets);
+	extract_end();
+
+	for (int i = 0; i < npaths && missing >= 0; i++) {
+		const char *path = paths[i];
+		int found = 0;
+
+		while (*path == '/') path++;
+		list_for_each(_file, &subset.pkg.files) {
+			pkg_file_t *file = _file->data;
+			size_t len = strlen(file->path);
+			if (!strncmp(path, file->path, len) &&
+			    (!path[len] || !strcmp(path + len, "/")))
+				found = 1;
+		}
+		if (!found) {
+			fprintf(stderr, "%s: not found in %s\n", paths[i],
+			        pkg_path);
+			missing++;
+		}
+	}
+
+	list_for_each(_link, &subset.links) {
+		subset_link_t *link = _link->data;
+		if (!link->done && missing >= 0)
+			fprintf(stderr, "%s: link target %s not found in %s\n",
+			        link->file->path, link->target, pkg_path);
+		free(link->target);
+		free(link);
+	}
+	list_free(&subset.links);
+	list_for_each(_file, &subset.pkg.files) pkg_free_file(_file->data);
+	list_free(&subset.pkg.files);
+	fclose(pkgf);
+	if (fchdir(fileno(curdir)) < 0) die("Can't go back to CWD");
+	fclose(curdir);
+	return missing;
+}
@@ -22,8 +22,11 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/file.h>
 #include <sys/param.h>
@@ -31,11 +34,22 @@
 
 #define PKG_DB_DIR   LOCALSTATEDIR"/lib/pkg"
 #define PKG_DB_FILE  PKG_DB_DIR"/db"
+// content store objects files were installed from, see store.c
+#define PKG_DB_REFS  PKG_DB_DIR"/refs"
+#define PKG_REFS_LINE_MAX (MAXPATHLEN + 128)
+// sizes of the files as they were installed, for pkginfo --size
+#define PKG_DB_SIZES PKG_DB_DIR"/sizes"
 
 char *opt_root;
+int opt_sync = PKG_SYNC_PACKAGE;
 list_t pkg_db;
 int db_lock;
 
+// set when committing of the changed database is deferred to the end of
+// the transaction
+static
+int db_dirty;
+
 void pkg_lock_db(void) {
 	char *dbdirpath;
 
@@ -56,8 +70,9 @@ void pkg_unlock_db(void) {
 	return;
 }
 
-static
-void pkg_read_db(FILE *pkg_db_file) {
+// Reads package records in the database format from pkg_db_file, and
+// appends them to pkgs.
+void pkg_read_desc(FILE *pkg_db_file, list_t *pkgs) {
 	char *line = fmalloc(MAXPATHLEN+1);
 	size_t line_size;
 	int cnt = 0;
@@ -70,7 +85,7 @@ void pkg_read_db(FILE *pkg_db_file) {
 
 		if (line[0] == '\0') {
 			cnt = 0;
-			list_append(&pkg_db, pkg);
+			list_append(pkgs, pkg);
 			continue;
 		}
 
@@ -89,6 +104,8 @@ void pkg_read_db(FILE *pkg_db_file) {
 				file = fmalloc(sizeof(pkg_file_t));
 				file->pkg = pkg;
 				file->conflict = CONFLICT_NONE;
+				file->ref = NULL;
+				file->size = -1;
 				file->path = fmalloc(line_size);
 				strcpy(file->path, line);
 				line_size = strlen(file->path) + 1;
@@ -97,6 +114,7 @@ void pkg_read_db(FILE *pkg_db_file) {
 					file->path[line_size-2] = '\0';
 				}
 				else file->mode = 0;
+				file->type = file->mode;
 				list_append(&pkg->files, file);
 				break;
 		}
@@ -105,20 +123,226 @@ void pkg_read_db(FILE *pkg_db_file) {
 	return;
 }
 
+void pkg_write_desc(FILE *f, pkg_desc_t *pkg) {
+	fputs(pkg->name, f);
+	fputc('\n', f);
+	fputs(pkg->version, f);
+	fputc('\n', f);
+
+	list_for_each(_file, &pkg->files) {
+		pkg_file_t *file = _file->data;
+		fputs(file->path, f);
+		if (S_ISDIR(file->mode)) fputc('/', f);
+		fputc('\n', f);
+	}
+	fputc('\n', f);
+	return;
+}
+
+void pkg_free_desc(pkg_desc_t *pkg) {
+	list_for_each(_file, &pkg->files) {
+		pkg_file_t *file = _file->data;
+		pkg_free_file(file);
+	}
+	list_free(&pkg->files);
+	free(pkg->name);
+	free(pkg->version);
+	free(pkg);
+	return;
+}
+
 void pkg_free_db(void) {
+	list_for_each(_pkg, &pkg_db) pkg_free_desc(_pkg->data);
+	list_free(&pkg_db);
+	return;
+}
+
+static
+char *root_path(const char *path, const char *suffix) {
+	char *tmp = fmalloc(strlen(opt_root) + strlen(path) +
+	                    strlen(suffix) + 1);
+	strcpy(tmp, opt_root);
+	strcat(tmp, path);
+	strcat(tmp, suffix);
+	return tmp;
+}
+
+// Reads store references. The file consists of the blocks of the same
+// order as in the database: package name, then "<ref> <path>" lines for
+// files installed from the store, then an empty line.
+static
+void pkg_read_refs(void) {
+	char *line = fmalloc(PKG_REFS_LINE_MAX);
+	char *refspath, *path;
+	pkg_desc_t *pkg = NULL;
+	list_entry_t *_file = NULL, *i;
+	int in_block = 0;
+	FILE *f;
+
+	refspath = root_path(PKG_DB_REFS, "");
+	f = fopen(refspath, "r");
+	free(refspath);
+	if (!f) {
+		free(line);
+		return;
+	}
+
+	while (fgets(line, PKG_REFS_LINE_MAX, f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '\0') {
+			in_block = 0;
+			continue;
+		}
+		if (!in_block) {
+			in_block = 1;
+			pkg = pkg_find_pkg(line);
+			if (pkg) _file = pkg->files.head;
+			continue;
+		}
+		if (!pkg || !(path = strchr(line, ' '))) continue;
+		*path++ = '\0';
+
+		// paths come in the database order, so just follow the list
+		for (i = _file->next; i->next; i = i->next) {
+			pkg_file_t *file = i->data;
+			if (strcmp(file->path, path)) continue;
+			free(file->ref);
+			file->ref = strdup(line);
+			_file = i;
+			break;
+		}
+	}
+	fclose(f);
+	free(line);
+	return;
+}
+
+static
+void pkg_write_refs(void) {
+	char *refspath, *new_refspath;
+	FILE *f = NULL;
+
+	refspath = root_path(PKG_DB_REFS, "");
+	new_refspath = root_path(PKG_DB_REFS, ".new");
+
 	list_for_each(_pkg, &pkg_db) {
 		pkg_desc_t *pkg = _pkg->data;
+		int header = 0;
 		list_for_each(_file, &pkg->files) {
 			pkg_file_t *file = _file->data;
-			free(file->path);
-			free(file);
+			if (!file->ref) continue;
+			if (!f) {
+				f = fopen(new_refspath, "w");
+				if (!f) die(new_refspath);
+			}
+			if (!header) {
+				fprintf(f, "%s\n", pkg->name);
+				header = 1;
+			}
+			fprintf(f, "%s %s\n", file->ref, file->path);
 		}
-		free(pkg->name);
-		free(pkg->version);
-		list_free(&pkg->files);
-		free(pkg);
+		if (header) fputc('\n', f);
 	}
-	list_free(&pkg_db);
+
+	if (f) {
+		fflush(f);
+		if (opt_sync != PKG_SYNC_NONE) fsync(fileno(f));
+		fclose(f);
+		if (rename(new_refspath, refspath))
+			die("Can't replace store references");
+	}
+	else if (unlink(refspath) && errno != ENOENT) die(refspath);
+	free(refspath);
+	free(new_refspath);
+	return;
+}
+
+// Reads file sizes. The file consists of the blocks of the same order as
+// in the database: package name, then "<size> <path>" lines for the
+// files of nonzero size, then an empty line. Packages without a block,
+// installed before sizes were recorded, keep unknown sizes.
+static
+void pkg_read_sizes(void) {
+	char *line = fmalloc(PKG_REFS_LINE_MAX);
+	char *sizespath, *path;
+	pkg_desc_t *pkg = NULL;
+	list_entry_t *_file = NULL, *i;
+	int in_block = 0;
+	FILE *f;
+
+	sizespath = root_path(PKG_DB_SIZES, "");
+	f = fopen(sizespath, "r");
+	free(sizespath);
+	if (!f) {
+		free(line);
+		return;
+	}
+
+	while (fgets(line, PKG_REFS_LINE_MAX, f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '\0') {
+			in_block = 0;
+			continue;
+		}
+		if (!in_block) {
+			in_block = 1;
+			pkg = pkg_find_pkg(line);
+			if (!pkg) continue;
+			_file = pkg->files.head;
+			list_for_each(_f, &pkg->files)
+				((pkg_file_t *)_f->data)->size = 0;
+			continue;
+		}
+		if (!pkg || !(path = strchr(line, ' '))) continue;
+		*path++ = '\0';
+
+		for (i = _file->next; i->next; i = i->next) {
+			pkg_file_t *file = i->data;
+			if (strcmp(file->path, path)) continue;
+			file->size = strtoll(line, NULL, 10);
+			_file = i;
+			break;
+		}
+	}
+	fclose(f);
+	free(line);
+	return;
+}
+
+static
+void pkg_write_sizes(void) {
+	char *sizespath, *new_sizespath;
+	FILE *f;
+
+	sizespath = root_path(PKG_DB_SIZES, "");
+	new_sizespath = root_path(PKG_DB_SIZES, ".new");
+	f = fopen(new_sizespath, "w");
+	if (!f) die(new_sizespath);
+
+	list_for_each(_pkg, &pkg_db) {
+		pkg_desc_t *pkg = _pkg->data;
+		int known = 1;
+		list_for_each(_file, &pkg->files)
+			if (((pkg_file_t *)_file->data)->size < 0) known = 0;
+		if (!known) continue;
+
+		fprintf(f, "%s\n", pkg->name);
+		list_for_each(_file, &pkg->files) {
+			pkg_file_t *file = _file->data;
+			if (file->size)
+				fprintf(f, "%jd %s\n", (intmax_t)file->size,
+				        file->path);
+		}
+		fputc('\n', f);
+	}
+
+	fflush(f);
+	if (opt_sync != PKG_SYNC_NONE) fsync(fileno(f));
+	fclose(f);
+	if (rename(new_sizespath, sizespath))
+		die("Can't replace file sizes");
+	free(sizespath);
+	free(new_sizespath);
 	return;
 }
 
@@ -134,7 +358,9 @@ void pkg_init_db(void) {
 	if (!pkg_db_file) die(dbpath);
 
 	list_init(&pkg_db);
-	pkg_read_db(pkg_db_file);
+	pkg_read_desc(pkg_db_file, &pkg_db);
+	pkg_read_refs();
+	pkg_read_sizes();
 
 	if (fclose(pkg_db_file)) die("Can't close database");
 	free(dbpath);
@@ -179,28 +405,57 @@ int pkg_commit_db(void) {
 	if (!new_dbfile) die(new_dbpath);
 
 	sort_db();
-	list_for_each(_pkg, &pkg_db) {
-		pkg_desc_t *pkg = _pkg->data;
-		fputs(pkg->name, new_dbfile);
-		fputc('\n', new_dbfile);
-		fputs(pkg->version, new_dbfile);
-		fputc('\n', new_dbfile);
-
-		list_for_each(_file, &pkg->files) {
-			pkg_file_t *file = _file->data;
-			fputs(file->path, new_dbfile);
-			if (S_ISDIR(file->mode)) fputc('/', new_dbfile);
-			fputc('\n', new_dbfile);
-		}
-		fputc('\n', new_dbfile);
-	}
+	pkg_write_refs();
+	pkg_write_sizes();
+	list_for_each(_pkg, &pkg_db) pkg_write_desc(new_dbfile, _pkg->data);
 	fflush(new_dbfile);
-	fsync(fileno(new_dbfile));
+	if (opt_sync != PKG_SYNC_NONE) fsync(fileno(new_dbfile));
 	fclose(new_dbfile);
 
 	if (rename(new_dbpath, dbpath))
 		die("Can't replace old database");
+	// make the rename itself durable, db_lock is the database directory
+	if (opt_sync != PKG_SYNC_NONE && fsync(db_lock))
+		die("Can't sync database directory");
 	free(dbpath);
 	free(new_dbpath);
+	db_dirty = 0;
 	return 0;
 }
+
+// flushes everything written under the root to the disk
+static
+void sync_root(void) {
+	int fd;
+
+	fd = open(strcmp(opt_root, "") ? opt_root : "/",
+	          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) die("Can't open root directory");
+	if (syncfs(fd)) die("Can't sync root file system");
+	close(fd);
+	return;
+}
+
+// Called by pkg_add() and pkg_rm() when the package files are in place
+// and pkg_db is updated. In batch mode files are synced and database is
+// committed once, by pkg_end_transaction(), so packages processed before
+// a failure are not recorded; that's why it's not the default.
+void pkg_update_db(void) {
+	if (opt_sync == PKG_SYNC_BATCH) {
+		db_dirty = 1;
+		return;
+	}
+	if (opt_sync == PKG_SYNC_FULL) sync_root();
+	pkg_commit_db();
+	return;
+}
+
+// Finishes what was deferred till the end of a pkgadd or pkgrm run.
+void pkg_end_transaction(void) {
+	if (db_dirty) {
+		sync_root();
+		pkg_commit_db();
+	}
+	run_ldconfig();
+	return;
+}
@@ -21,121 +21,103 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <errno.h>
-#include <sys/param.h>
 #include <pkgutils/pkgutils.h>
 
-static
-void delete_ref(void **ai, void **bj, void *arg) {
-	pkg_desc_t *pkg2rm = arg;
-	pkg_file_t *pkgfile = (*(list_entry_t**)ai)->data;
-
-	dbg("ref %s\n", pkgfile->path);
-	free(pkgfile->path);
-	free(pkgfile);
-	list_delete(&pkg2rm->files, *(list_entry_t**)ai);
-	
+// Files of the packages being removed which are still referenced by
+// packages staying installed. They stay on the filesystem.
+static inline
+void keep_ref(path_key_t *ai, path_key_t *bj, void *arg) {
+	dbg("ref %s\n", ai->path);
+	ai->entry = NULL;
 	return;
 }
 
-// Delete from the list files which referenced by other packages.
-// Thus they will not removed from the filesystem.
+DEFINE_MERGE_JOIN(join_kept_refs, path_key_t, path_key_compare, keep_ref)
+
+// Returns sorted array of files of all packages in the pkgs list, with
+// paths shared by several of them listed once.
 static
-void delete_refs(pkg_desc_t *pkg2rm) {
-	size_t dbsize = 0, cnt;
-	void **dbfiles, **pkgfiles;
-
-	// creating db files sorted array
-	list_for_each(_dbpkg, &pkg_db) {
-		pkg_desc_t *dbpkg = _dbpkg->data;
-		if (dbpkg == pkg2rm) continue;
-		dbsize += dbpkg->files.size;
-	}
+path_key_t *collect_files(list_t *pkgs, size_t *size) {
+	size_t cnt = 0, i, n;
+	path_key_t *files;
 
-	dbfiles = fmalloc(dbsize * sizeof(void*));
+	list_for_each(_pkg, pkgs) cnt += ((pkg_desc_t *)_pkg->data)->files.size;
+
+	files = fmalloc((cnt ? cnt : 1) * sizeof(path_key_t));
 	cnt = 0;
-	list_for_each(_dbpkg, &pkg_db) {
-		pkg_desc_t *dbpkg = _dbpkg->data;
-		if (dbpkg == pkg2rm) continue;
-		list_for_each(_dbfile, &dbpkg->files) {
-			dbfiles[cnt] = _dbfile;
-			cnt++;
-		}
+	list_for_each(_pkg, pkgs) {
+		pkg_desc_t *pkg = _pkg->data;
+		cnt += path_keys_add(files + cnt, &pkg->files);
 	}
-	qsort(dbfiles, dbsize, sizeof(void*), file_cmp);
+	path_keys_sort(files, cnt);
 
-	// creating pkg files sorted array
-	pkgfiles = fmalloc(pkg2rm->files.size * sizeof(void*));
-	cnt = 0;
-	list_for_each(_file, &pkg2rm->files) {
-		pkgfiles[cnt] = _file;
-		cnt++;
+	for (i = n = 0; i < cnt; i++) {
+		if (n && !path_key_compare(&files[n-1], &files[i])) continue;
+		files[n++] = files[i];
 	}
-	qsort(pkgfiles, pkg2rm->files.size, sizeof(void*), file_cmp);
-	
-	// find intersections in pkg files and db files
-	intersect_uniq(pkgfiles, pkg2rm->files.size, dbfiles, dbsize,
-	               file_cmp, delete_ref, NULL, pkg2rm);
-	
-	free(pkgfiles);
-	free(dbfiles);
-	return;
+	*size = n;
+	return files;
 }
 
 // unlink files from the filesystem
 static
-void remove_from_fs(pkg_desc_t *pkg2rm) {
-	char *tmp = fmalloc(MAXPATHLEN+1);
-	size_t root_len = strlen(opt_root);
-
-	strcpy(tmp, opt_root);
-	strcat(tmp, "/");
-	root_len++;
-
-	list_for_each_r(_file2rm, &pkg2rm->files) {
-		pkg_file_t *file2rm = _file2rm->data;
-		tmp[root_len] = '\0';
-		strcat(tmp, file2rm->path);
-		dbg("removing %s\n", tmp);
-		if (remove(tmp))
-			fprintf(stderr, "Can't remove %s: %s\n", tmp,
-			        strerror(errno));
-		_file2rm = _file2rm->next;
-		list_delete(&pkg2rm->files, _file2rm->prev);
-		free(file2rm->path);
-		free(file2rm);
-	}
-	list_free(&pkg2rm->files);
-	free(tmp);
+void remove_from_fs(path_key_t *files, size_t size) {
+	unlink_begin(opt_root);
+	for (size_t i = 0; i < size; i++)
+		if (files[i].entry) unlink_file(files[i].entry->data);
+	unlink_end();
+	return;
 }
 
-int pkg_rm(const char *pkg_name) {
-	pkg_desc_t *pkg2rm = NULL;
-	list_entry_t *_pkg2rm = NULL;
-	
-	list_for_each(_dbpkg, &pkg_db) {
-		pkg_desc_t *dbpkg = _dbpkg->data;
-		if (strcmp(dbpkg->name, pkg_name)) continue;
-		_pkg2rm = _dbpkg;
-		pkg2rm = dbpkg;
-		break;
+// Removes a set of packages as one transaction: the files no longer
+// referenced once all of them are gone are found in a single merge pass
+// against the rest of the database, which is then updated once.
+int pkg_rm_pkgs(int npkgs, char *pkg_names[]) {
+	list_t rm_pkgs;
+	path_key_t *rmfiles, *dbfiles;
+	size_t rmsize, dbsize;
+	int ret = 0;
+
+	list_init(&rm_pkgs);
+	for (int i = 0; i < npkgs; i++) {
+		list_entry_t *_pkg2rm = NULL;
+
+		list_for_each(_dbpkg, &pkg_db) {
+			pkg_desc_t *dbpkg = _dbpkg->data;
+			if (strcmp(dbpkg->name, pkg_names[i])) continue;
+			_pkg2rm = _dbpkg;
+			break;
+		}
+		if (!_pkg2rm) {
+			fprintf(stderr, "Package \"%s\" is not installed\n",
+			        pkg_names[i]);
+			ret = -1;
+			continue;
+		}
+		list_append(&rm_pkgs, _pkg2rm->data);
+		list_delete(&pkg_db, _pkg2rm);
 	}
-
-	if (!pkg2rm) {
-		fprintf(stderr, "Package \"%s\" is not installed\n", pkg_name);
-		return -1;
+	if (!rm_pkgs.size) {
+		list_free(&rm_pkgs);
+		return ret;
 	}
 
-	delete_refs(pkg2rm);
-	remove_from_fs(pkg2rm);
+	ldconfig_init();
+	rmfiles = collect_files(&rm_pkgs, &rmsize);
+	dbfiles = collect_files(&pkg_db, &dbsize);
+	join_kept_refs(rmfiles, rmsize, dbfiles, dbsize, NULL);
+	free(dbfiles);
+
+	remove_from_fs(rmfiles, rmsize);
+	free(rmfiles);
 
-	free(pkg2rm->name);
-	free(pkg2rm->version);
-	free(pkg2rm);
-	list_delete(&pkg_db, _pkg2rm);
-	pkg_commit_db();
+	list_for_each(_pkg, &rm_pkgs) pkg_free_desc(_pkg->data);
+	list_free(&rm_pkgs);
+	pkg_update_db();
 
-	run_ldconfig();
+	return ret;
+}
 
-	return 0;
+int pkg_rm(const char *pkg_name) {
+	return pkg_rm_pkgs(1, (char **)&pkg_name);
 }
@@ -0,0 +1,314 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Manifest cache. Listing a package archive means inflating all of it,
+// so the headers of its entries are kept in MANIFEST_DIR under the root,
+// in a file named after device and inode of the archive. The file starts
+// with the archive size and mtime, and is only used while they match.
+// Then every entry follows as "mode uid gid size major minor kind" line,
+// where kind is 'h' for hard links, 's' for symlinks and '-' otherwise,
+// with NUL terminated path and link target (if any) appended.
+//
+// Packages made by pkgmk carry the same listing as their first member,
+// PKG_MANIFEST, so it's enough to inflate the head of the package. Its
+// lines are "mode uid gid size major minor kind", then tab separated
+// path and link target, with device numbers in hex. The first line is
+// "pkgutils-manifest 1".
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pkgutils/pkgutils.h>
+
+#define MANIFEST_DIR     LOCALSTATEDIR"/cache/pkg/manifest"
+#define MANIFEST_VERSION 1
+#define MANIFEST_HEADER  "pkgutils-manifest 1\n"
+// bigger embedded manifests are ignored
+#define MANIFEST_MAX_SIZE (16 << 20)
+
+typedef struct {
+	FILE *out;
+	do_archive_fun_t func;
+	void *arg1;
+	void *arg2;
+} recorder_t;
+
+// the cache directory, -1 if it's not available
+static int cache_dir = -2;
+
+// Opens the cache directory. It must be called before chdir() to the root
+// when opt_root is relative, otherwise the first do_manifest() does it.
+void manifest_init(void) {
+	char path[MAXPATHLEN+1];
+
+	if (cache_dir != -2) return;
+	snprintf(path, sizeof(path), "%s%s/", opt_root, MANIFEST_DIR);
+	make_parents(path);
+	cache_dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	return;
+}
+
+static
+void cache_name(char *buf, const struct stat *st) {
+	snprintf(buf, 64, "%llx-%llx", (unsigned long long)st->st_dev,
+	         (unsigned long long)st->st_ino);
+	return;
+}
+
+static
+struct archive_entry *new_entry(unsigned int mode, unsigned int uid,
+                                 unsigned int gid, long long size,
+                                 unsigned int major, unsigned int minor,
+                                 char kind, const char *path,
+                                 const char *target) {
+	struct archive_entry *en = archive_entry_new();
+	if (!en) die("archive_entry_new");
+	archive_entry_copy_pathname(en, path);
+	archive_entry_set_mode(en, mode);
+	archive_entry_set_uid(en, uid);
+	archive_entry_set_gid(en, gid);
+	archive_entry_set_size(en, size);
+	archive_entry_set_rdevmajor(en, major);
+	archive_entry_set_rdevminor(en, minor);
+	if (kind == 'h') archive_entry_copy_hardlink(en, target);
+	else if (kind == 's') archive_entry_copy_symlink(en, target);
+	return en;
+}
+
+// Calls func for entries, if ret is 0, and frees them
+static
+int play(list_t *entries, int ret, do_archive_fun_t func, void *arg1,
+         void *arg2) {
+	list_for_each(_en, entries) {
+		if (!ret) func(NULL, _en->data, arg1, arg2);
+		archive_entry_free(_en->data);
+	}
+	list_free(entries);
+	return ret;
+}
+
+// Calls func for the cached entries of the package, which must not read
+// any data. Returns -1 if there is no valid cache for it.
+static
+int replay(const struct stat *st, do_archive_fun_t func, void *arg1,
+           void *arg2) {
+	char name[64];
+	unsigned int mode, uid, gid, major, minor, version;
+	long long size, mtime, mtime_nsec;
+	char *path = NULL, *target = NULL;
+	size_t path_size = 0, target_size = 0;
+	list_t entries;
+	char kind;
+	FILE *f;
+	int fd, ret;
+
+	cache_name(name, st);
+	fd = openat(cache_dir, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -1;
+	}
+	if (fscanf(f, "%u %lld %lld %lld\n", &version, &size, &mtime,
+	           &mtime_nsec) != 4 || version != MANIFEST_VERSION ||
+	    size != st->st_size || mtime != st->st_mtim.tv_sec ||
+	    mtime_nsec != st->st_mtim.tv_nsec) {
+		fclose(f);
+		return -1;
+	}
+
+	// everything is read first, a damaged cache is then just ignored
+	list_init(&entries);
+	while (1) {
+		ret = fscanf(f, "%o %u %u %lld %u %u %c", &mode, &uid, &gid,
+		             &size, &major, &minor, &kind);
+		if (ret == EOF) {
+			ret = 0;
+			break;
+		}
+		// fields are separated from the path by one space
+		if (ret != 7 || fgetc(f) != ' ' ||
+		    getdelim(&path, &path_size, '\0', f) < 0 ||
+		    (kind != '-' &&
+		     getdelim(&target, &target_size, '\0', f) < 0) ||
+		    fgetc(f) != '\n') {
+			ret = -1;
+			break;
+		}
+
+		list_append(&entries, new_entry(mode, uid, gid, size, major,
+		                                minor, kind, path, target));
+	}
+	free(path);
+	free(target);
+	fclose(f);
+	return play(&entries, ret, func, arg1, arg2);
+}
+
+// Reads the manifest embedded at the head of the package, and calls func
+// for its entries. Returns -1 if there is none.
+static
+int replay_embedded(FILE *pkg, do_archive_fun_t func, void *arg1,
+                    void *arg2) {
+	struct archive *ar;
+	struct archive_entry *en;
+	unsigned int mode, uid, gid, major, minor;
+	long long size;
+	char *buf, *line, *path, *target, *end;
+	list_t entries;
+	char kind;
+	int ret = -1;
+
+	fseek(pkg, 0L, SEEK_SET);
+	ar = archive_read_new();
+	if (!ar) die("archive_read_new");
+	archive_read_support_format_tar(ar);
+	archive_read_support_compression_gzip(ar);
+	if (archive_read_open_FILE(ar, pkg) != ARCHIVE_OK ||
+	    archive_read_next_header(ar, &en) != ARCHIVE_OK ||
+	    strcmp(archive_entry_pathname(en), PKG_MANIFEST) ||
+	    archive_entry_size(en) > MANIFEST_MAX_SIZE) {
+		archive_read_finish(ar);
+		return -1;
+	}
+	size = archive_entry_size(en);
+	buf = fmalloc(size + 1);
+	if (archive_read_data(ar, buf, size) != size) {
+		archive_read_finish(ar);
+		free(buf);
+		return -1;
+	}
+	archive_read_finish(ar);
+	buf[size] = '\0';
+	if (strncmp(buf, MANIFEST_HEADER, sizeof(MANIFEST_HEADER) - 1)) {
+		free(buf);
+		return -1;
+	}
+
+	list_init(&entries);
+	for (line = buf + sizeof(MANIFEST_HEADER) - 1; *line; line = end + 1) {
+		end = strchr(line, '\n');
+		path = strchr(line, '\t');
+		if (!end || !path || path > end ||
+		    sscanf(line, "%o %u %u %lld %x %x %c", &mode, &uid, &gid,
+		           &size, &major, &minor, &kind) != 7)
+			break;
+		*end = '\0';
+		*path++ = '\0';
+		target = strchr(path, '\t');
+		if (!target) break;
+		*target++ = '\0';
+		list_append(&entries, new_entry(mode, uid, gid, size, major,
+		                                minor, kind, path, target));
+	}
+	ret = *line ? -1 : 0;
+	free(buf);
+	return play(&entries, ret, func, arg1, arg2);
+}
+
+static
+void record(struct archive *ar, struct archive_entry *en, void *_rec,
+            void *unused) {
+	recorder_t *rec = _rec;
+	const char *target = NULL;
+	char kind = '-';
+
+	if ((target = archive_entry_hardlink(en))) kind = 'h';
+	else if ((target = archive_entry_symlink(en))) kind = 's';
+
+	if (rec->out) {
+		fprintf(rec->out, "%o %u %u %lld %u %u %c ",
+		        (unsigned int)archive_entry_mode(en),
+		        (unsigned int)archive_entry_uid(en),
+		        (unsigned int)archive_entry_gid(en),
+		        (long long)archive_entry_size(en),
+		        (unsigned int)archive_entry_rdevmajor(en),
+		        (unsigned int)archive_entry_rdevminor(en), kind);
+		fputs(archive_entry_pathname(en), rec->out);
+		fputc('\0', rec->out);
+		if (target) {
+			fputs(target, rec->out);
+			fputc('\0', rec->out);
+		}
+		fputc('\n', rec->out);
+	}
+	rec->func(ar, en, rec->arg1, rec->arg2);
+	return;
+}
+
+// The same as do_archive(), but only for listing entries: func gets NULL
+// instead of the archive and may not read the data. Entries are taken
+// from the manifest cache if the package is there, or from the embedded
+// manifest, otherwise the package is read and the cache is filled.
+int do_manifest(FILE *pkg, do_archive_fun_t func, void *arg1, void *arg2) {
+	char name[64], tmp[96];
+	recorder_t rec = { NULL, func, arg1, arg2 };
+	struct stat st;
+	int fd, err;
+
+	manifest_init();
+	if (fstat(fileno(pkg), &st) || !S_ISREG(st.st_mode))
+		return do_archive(pkg, func, arg1, arg2);
+	if (cache_dir >= 0 && !replay(&st, func, arg1, arg2)) return 0;
+	if (!replay_embedded(pkg, func, arg1, arg2)) return 0;
+	if (cache_dir < 0) return do_archive(pkg, func, arg1, arg2);
+
+	cache_name(name, &st);
+	snprintf(tmp, sizeof(tmp), "%s.%d", name, (int)getpid());
+	// the same archive may be read by another thread of pkginfo -f
+	fd = openat(cache_dir, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+	            0644);
+	if (fd >= 0 && !(rec.out = fdopen(fd, "w"))) close(fd);
+	if (rec.out)
+		fprintf(rec.out, "%u %lld %lld %lld\n", MANIFEST_VERSION,
+		        (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+		        (long long)st.st_mtim.tv_nsec);
+
+	err = do_archive(pkg, record, &rec, NULL);
+	if (rec.out) {
+		if (fclose(rec.out) || err || renameat(cache_dir, tmp,
+		                                        cache_dir, name))
+			unlinkat(cache_dir, tmp, 0);
+	}
+	return err;
+}
+
+int do_manifest_once(const char *fname, do_archive_fun_t func, void *arg1,
+                     void *arg2) {
+	FILE *pkgf;
+	int err;
+	pkgf = fopen(fname, "r");
+	if (!pkgf) {
+		fprintf(stderr, "Can't open %s: %s\n", fname,
+		        strerror(errno));
+		return -1;
+	}
+	err = do_manifest(pkgf, func, arg1, arg2);
+	fclose(pkgf);
+	return err;
+}
@@ -24,11 +24,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <elf.h>
+#include <glob.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <ftw.h>
 #include <unistd.h>
 #include <pkgutils/pkgutils.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 void pkgutils_version(void) {
 	puts("pkgutils-c "VERSION" (C rewrite)\n\n"
@@ -67,6 +79,79 @@ const char *base_filename(const char *name) {
 	return name;
 }
 
+void pkg_free_file(pkg_file_t *file) {
+	free(file->path);
+	free(file->ref);
+	free(file);
+	return;
+}
+
+// Creates missing parent directories of path, the same way libarchive
+// does for the entries which come without their directories.
+void make_parents(const char *path) {
+	char tmp[MAXPATHLEN+1];
+	char *slash;
+
+	strncpy(tmp, path, MAXPATHLEN);
+	tmp[MAXPATHLEN] = '\0';
+	for (slash = strchr(tmp + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(tmp, 0755) && errno != EEXIST) return;
+		*slash = '/';
+	}
+	return;
+}
+
+// write() which does not give up on short writes
+int write_all(int fd, const void *buf, size_t size) {
+	const char *p = buf;
+	ssize_t ret;
+	while (size) {
+		ret = write(fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return 0;
+}
+
+// Copies contents of src to dst, both positioned at the beginning.
+// Returns 0 on success, -1 with errno set otherwise.
+int copy_fd(int src, int dst) {
+	char buf[65536];
+	ssize_t ret;
+
+	// FICLONE shares the extents, copy_file_range() may still do a
+	// server side or in-kernel copy
+	if (!ioctl(dst, FICLONE, src)) return 0;
+	while ((ret = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0)) > 0);
+	if (!ret) return 0;
+	if (lseek(src, 0, SEEK_SET) || lseek(dst, 0, SEEK_SET) ||
+	    ftruncate(dst, 0))
+		return -1;
+	while ((ret = read(src, buf, sizeof(buf))) > 0)
+		if (write_all(dst, buf, ret)) return -1;
+	return ret;
+}
+
+static
+int remove_entry(const char *path, const struct stat *st, int flag,
+                 struct FTW *ftw) {
+	if (remove(path))
+		fprintf(stderr, "Can't remove %s/%s: %s\n", opt_root, path,
+		        strerror(errno));
+	return 0;
+}
+
+// Removes directory tree path, which is relative to the root
+void remove_tree(const char *path) {
+	nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return;
+}
+
 int pkg_cmp(const void *a, const void *b) {
 	pkg_desc_t *pkga = *(pkg_desc_t**)a;
 	pkg_desc_t *pkgb = *(pkg_desc_t**)b;
@@ -79,6 +164,74 @@ int file_cmp(const void *a, const void *b) {
 	return strcmp(filea->path, fileb->path);
 }
 
+void path_key_set(path_key_t *key, const char *path, list_entry_t *entry) {
+	int i;
+
+	key->prefix[0] = key->prefix[1] = 0;
+	for (i = 0; i < PATH_KEY_SIZE && path[i]; i++)
+		key->prefix[i / 8] |= (uint64_t)(unsigned char)path[i] <<
+		                      (56 - 8 * (i % 8));
+	key->path = path;
+	key->entry = entry;
+	return;
+}
+
+// Appends the keys of files to keys, returns how many
+size_t path_keys_add(path_key_t *keys, list_t *files) {
+	size_t cnt = 0;
+
+	list_for_each(_file, files) {
+		path_key_set(&keys[cnt], ((pkg_file_t *)_file->data)->path,
+		             _file);
+		cnt++;
+	}
+	return cnt;
+}
+
+#define PATH_KEYS_RUN 16
+
+// Sorts keys the same way qsort() would with path_key_compare(), but
+// faster: qsort() calls the comparison through a pointer and copies keys
+// bytewise, as they are bigger than a pointer. Bottom-up merge sort of
+// insertion sorted runs.
+void path_keys_sort(path_key_t *keys, size_t n) {
+	path_key_t *src = keys, *dst, *tmp;
+
+	for (size_t lo = 0; lo < n; lo += PATH_KEYS_RUN) {
+		size_t hi = MIN(lo + PATH_KEYS_RUN, n);
+		for (size_t i = lo + 1; i < hi; i++) {
+			path_key_t key = keys[i];
+			size_t j;
+			for (j = i; j > lo &&
+			            path_key_compare(&key, &keys[j-1]) < 0; j--)
+				keys[j] = keys[j-1];
+			keys[j] = key;
+		}
+	}
+	if (n <= PATH_KEYS_RUN) return;
+
+	dst = tmp = fmalloc(n * sizeof(path_key_t));
+	for (size_t width = PATH_KEYS_RUN; width < n; width *= 2) {
+		for (size_t lo = 0; lo < n; lo += 2 * width) {
+			size_t mid = MIN(lo + width, n);
+			size_t hi = MIN(lo + 2 * width, n);
+			size_t i = lo, j = mid, k = lo;
+
+			while (i < mid && j < hi)
+				dst[k++] = path_key_compare(&src[j], &src[i]) < 0 ?
+				           src[j++] : src[i++];
+			while (i < mid) dst[k++] = src[i++];
+			while (j < hi) dst[k++] = src[j++];
+		}
+		path_key_t *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if (src != keys) memcpy(keys, src, n * sizeof(path_key_t));
+	free(tmp);
+	return;
+}
+
 // find intersection
 void intersect_uniq(void **a, size_t asz, void **b, size_t bsz,
                     int (*cmpf)(const void *a, const void *b),
@@ -164,28 +317,79 @@ failed:
 	return err;
 }
 
-// Calls func for the every archive entry. Handy function, and also eliminates
-// code duplication. Returns 0 if succeeded.
-int do_archive(FILE *pkg, do_archive_fun_t func, void *arg1, void *arg2) {
-	struct archive *ar;
-	struct archive_entry *en;
-	int err = 0;
+// Maps the whole package file into memory, so libarchive reads it
+// straight from the page cache. Returns NULL if pkg is not a regular file
+// or can't be mapped, the stdio path should be used then.
+static
+void *map_pkg(FILE *pkg, size_t *size) {
+	struct stat st;
+	void *map;
 
-	fseek(pkg, 0L, SEEK_SET);
-	ar = archive_read_new();
-	if (!ar) malloc_failed();
-	archive_read_support_compression_gzip(ar);
-	archive_read_support_format_tar(ar);
-	if (archive_read_open_FILE(ar, pkg) != ARCHIVE_OK) {
-		puts(archive_error_string(ar));
-		err = -1;
-		goto failed;
+	if (fstat(fileno(pkg), &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return NULL;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(pkg), 0);
+	if (map == MAP_FAILED) return NULL;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return map;
+}
+
+#ifdef HAVE_LIBDEFLATE
+// packages which inflate to more than that are left to libarchive, which
+// inflates them chunk by chunk instead of keeping them in memory
+#define INFLATE_MAX_SIZE (256UL << 20)
+
+// Inflates the whole mapped package into memory using libdeflate, which
+// detects CPU features at runtime and picks its vectorized crc32 and
+// decoding routines accordingly. Returns NULL if the package is not a
+// single gzip member or is too big, the stock libarchive path should be
+// used then.
+static
+void *inflate_pkg(const unsigned char *in, size_t in_size, size_t *size) {
+	struct libdeflate_decompressor *d;
+	void *out = NULL;
+	size_t isize, in_used;
+
+	if (in_size < 18 || in_size > INFLATE_MAX_SIZE ||
+	    in[0] != 0x1f || in[1] != 0x8b)
+		return NULL;
+
+	// gzip trailer holds uncompressed size modulo 2^32
+	isize = in[in_size-4]       | in[in_size-3] << 8 |
+	        in[in_size-2] << 16 | (size_t)in[in_size-1] << 24;
+	if (!isize || isize > INFLATE_MAX_SIZE) return NULL;
+
+	d = libdeflate_alloc_decompressor();
+	if (!d) malloc_failed();
+	out = fmalloc(isize);
+	if (libdeflate_gzip_decompress_ex(d, in, in_size, out, isize,
+	                                  &in_used, size) != LIBDEFLATE_SUCCESS ||
+	    in_used != in_size || *size != isize) {
+		// multi-member or damaged gzip, let libarchive deal with it
+		free(out);
+		out = NULL;
 	}
-	
+	libdeflate_free_decompressor(d);
+	return out;
+}
+#endif
+
+// Calls func for the every entry of opened archive ar, and frees ar.
+static
+int read_archive(struct archive *ar, do_archive_fun_t func, void *arg1,
+                 void *arg2) {
+	struct archive_entry *en;
+	int err, first = 1;
+
 	while (1) {
 		err = archive_read_next_header(ar, &en);
 		if (err == ARCHIVE_OK) {
-			func(ar, en, arg1, arg2);
+			// embedded manifest is not a part of the package
+			if (!first || strcmp(archive_entry_pathname(en),
+			                     PKG_MANIFEST))
+				func(ar, en, arg1, arg2);
+			first = 0;
 		}
 		else if (err == ARCHIVE_EOF) {
 			err = 0;
@@ -194,15 +398,68 @@ int do_archive(FILE *pkg, do_archive_fun_t func, void *arg1, void *arg2) {
 		else {
 			puts(archive_error_string(ar));
 			err = -1;
-			goto failed;
+			break;
 		}
 	}
 
-failed:
 	archive_read_finish(ar);
 	return err;
 }
 
+// Calls func for the every archive entry. Handy function, and also eliminates
+// code duplication. Returns 0 if succeeded.
+int do_archive(FILE *pkg, do_archive_fun_t func, void *arg1, void *arg2) {
+	struct archive *ar;
+	void *map, *tar = NULL;
+	size_t map_size = 0, tar_size = 0;
+	int err = 0;
+
+	fseek(pkg, 0L, SEEK_SET);
+	ar = archive_read_new();
+	if (!ar) malloc_failed();
+	archive_read_support_format_tar(ar);
+	map = map_pkg(pkg, &map_size);
+#ifdef HAVE_LIBDEFLATE
+	if (map) tar = inflate_pkg(map, map_size, &tar_size);
+#endif
+	if (tar)
+		err = archive_read_open_memory(ar, tar, tar_size);
+	else {
+		archive_read_support_compression_gzip(ar);
+		if (map)
+			err = archive_read_open_memory(ar, map, map_size);
+		else
+			err = archive_read_open_FILE(ar, pkg);
+	}
+	if (err != ARCHIVE_OK) {
+		puts(archive_error_string(ar));
+		archive_read_finish(ar);
+		err = -1;
+	}
+	else err = read_archive(ar, func, arg1, arg2);
+
+	free(tar);
+	if (map) munmap(map, map_size);
+	return err;
+}
+
+// The same as do_archive(), but for a package read from a stream, e.g. a
+// pipe. The stream is read once, from its current position.
+int do_archive_fd(int fd, do_archive_fun_t func, void *arg1, void *arg2) {
+	struct archive *ar;
+
+	ar = archive_read_new();
+	if (!ar) malloc_failed();
+	archive_read_support_format_tar(ar);
+	archive_read_support_compression_gzip(ar);
+	if (archive_read_open_fd(ar, fd, 65536) != ARCHIVE_OK) {
+		puts(archive_error_string(ar));
+		archive_read_finish(ar);
+		return -1;
+	}
+	return read_archive(ar, func, arg1, arg2);
+}
+
 int do_archive_once(const char *fname, do_archive_fun_t func, void *arg1,
                     void *arg2) {
 	FILE *pkgf;
@@ -289,25 +546,241 @@ int fetch_line_fields(char *line) {
 	return 0;
 }
 
-void run_ldconfig(void) {
-	// running ldconfig is meaningless when --root option specified
-	// because /sbin/ldconfig and /root/sbin/ldconfig could produce
-	// incompatible results. On the other hand /root/sbin/ldconfig
-	// may be infeasible for the host where pkgutils running, i.e.
-	// /root/sbin/ldconfig may be compiled for the different
-	// architecture, thus we can't blindly execute it.
-	if (strcmp(opt_root, ""))
+#define LD_SO_CONF "/etc/ld.so.conf"
+
+int opt_ldconfig;
+
+// directories ldconfig scans, without leading and trailing slashes
+static list_t lib_dirs;
+// library directories where shared objects were added or removed
+static list_t ldconfig_dirs;
+// set when ld.so.conf or a file it may include was touched, so the
+// directories above may be stale
+static int ldconfig_full;
+static pthread_mutex_t ldconfig_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ldconfig always scans these, and the dynamic linker searches them even
+// if a library is not in ld.so.cache
+static const char *trusted_dirs[] = {
+	"lib", "usr/lib", "lib64", "usr/lib64", NULL
+};
+
+static
+void add_lib_dir(list_t *dirs, const char *dir, size_t len) {
+	char *tmp;
+
+	while (len && dir[0] == '/') {
+		dir++;
+		len--;
+	}
+	while (len && dir[len-1] == '/') len--;
+
+	list_for_each(_dir, dirs) {
+		const char *d = _dir->data;
+		if (!strncmp(d, dir, len) && d[len] == '\0') return;
+	}
+	tmp = fmalloc(len + 1);
+	memcpy(tmp, dir, len);
+	tmp[len] = '\0';
+	list_append(dirs, tmp);
+	return;
+}
+
+static
+void read_ld_so_conf(const char *conf, int depth) {
+	char line[MAXPATHLEN+1];
+	char pattern[MAXPATHLEN+1];
+	char *p, *tok, *save;
+	FILE *f;
+	glob_t gl;
+	int dirlen;
+
+	f = fopen(conf, "r");
+	if (!f) return;
+	dirlen = base_filename(conf) - conf;
+
+	while (fgets(line, MAXPATHLEN+1, f)) {
+		if ((p = strchr(line, '#'))) *p = '\0';
+		p = line + strspn(line, " \t");
+
+		if (!strncmp(p, "include", 7) && (p[7] == ' ' || p[7] == '\t')) {
+			if (depth > 8) continue;
+			for (tok = strtok_r(p + 7, " \t\n", &save); tok;
+			     tok = strtok_r(NULL, " \t\n", &save)) {
+				// relative patterns are relative to the
+				// directory of the including file
+				if (tok[0] == '/')
+					snprintf(pattern, sizeof(pattern),
+					         "%s%s", opt_root, tok);
+				else
+					snprintf(pattern, sizeof(pattern),
+					         "%.*s%s", dirlen, conf, tok);
+				if (glob(pattern, 0, NULL, &gl)) continue;
+				for (size_t i = 0; i < gl.gl_pathc; i++)
+					read_ld_so_conf(gl.gl_pathv[i], depth+1);
+				globfree(&gl);
+			}
+			continue;
+		}
+
+		// directories are separated by spaces, tabs, colons, commas or
+		// newlines, "dir=TYPE" is an obsolete form of the entry
+		for (tok = strtok_r(p, " \t\n:,", &save); tok;
+		     tok = strtok_r(NULL, " \t\n:,", &save)) {
+			add_lib_dir(&lib_dirs, tok, strcspn(tok, "="));
+		}
+	}
+	fclose(f);
+	return;
+}
+
+// Reads the list of library directories. Must be called before any
+// chdir() to the root, as opt_root may be relative.
+void ldconfig_init(void) {
+	char *conf;
+
+	if (lib_dirs.head) return;
+	list_init(&lib_dirs);
+	list_init(&ldconfig_dirs);
+
+	for (int i = 0; trusted_dirs[i]; i++)
+		add_lib_dir(&lib_dirs, trusted_dirs[i], strlen(trusted_dirs[i]));
+
+	conf = fmalloc(strlen(opt_root) + sizeof(LD_SO_CONF));
+	strcpy(conf, opt_root);
+	strcat(conf, LD_SO_CONF);
+	read_ld_so_conf(conf, 0);
+	free(conf);
+	return;
+}
+
+static
+int is_shared_object(const unsigned char *hdr, size_t size) {
+	unsigned int type;
+
+	if (size < EI_NIDENT + 2 || memcmp(hdr, ELFMAG, SELFMAG))
+		return 0;
+	if (hdr[EI_DATA] == ELFDATA2MSB)
+		type = hdr[EI_NIDENT] << 8 | hdr[EI_NIDENT+1];
+	else
+		type = hdr[EI_NIDENT+1] << 8 | hdr[EI_NIDENT];
+	return type == ET_DYN;
+}
+
+// Returns the library directory path belongs to, or NULL.
+static
+const char *lib_dir_of(const char *path) {
+	const char *slash = strrchr(path, '/');
+	size_t len = slash ? (size_t)(slash - path) : 0;
+
+	list_for_each(_dir, &lib_dirs) {
+		const char *dir = _dir->data;
+		if (!strncmp(dir, path, len) && dir[len] == '\0')
+			return dir;
+	}
+	return NULL;
+}
+
+// Notes that full ldconfig must be run if path is ld.so.conf or under
+// ld.so.conf.d, as the library directories could have changed. Returns
+// nonzero if so.
+static
+int check_ld_so_conf(const char *path) {
+	size_t len = sizeof(LD_SO_CONF) - 2;
+
+	if (strncmp(path, LD_SO_CONF + 1, len) ||
+	    (path[len] && strncmp(path + len, ".d/", 3)))
+		return 0;
+	pthread_mutex_lock(&ldconfig_lock);
+	ldconfig_full = 1;
+	pthread_mutex_unlock(&ldconfig_lock);
+	return 1;
+}
+
+// Notes that ldconfig must be run if path (relative to the root) is a
+// shared object in a library directory, or a part of its configuration.
+// hdr holds the first size bytes of the file. Safe to call from the
+// extraction threads.
+void ldconfig_check_data(const char *path, const void *hdr, size_t size) {
+	const char *dir;
+
+	// ldconfig is never run for alternate roots anyway
+	if (strcmp(opt_root, "") || !lib_dirs.head) return;
+	if (check_ld_so_conf(path)) return;
+	if (!(dir = lib_dir_of(path)) || !is_shared_object(hdr, size))
 		return;
 
-	struct stat st;
-	if (stat("/sbin/ldconfig", &st))
+	pthread_mutex_lock(&ldconfig_lock);
+	add_lib_dir(&ldconfig_dirs, dir, strlen(dir));
+	pthread_mutex_unlock(&ldconfig_lock);
+	return;
+}
+
+// whether the file name of path is like the ones of shared objects and
+// the links ldconfig makes to them, "libfoo.so" or "libfoo.so.1.2"
+static
+int is_shared_object_name(const char *path) {
+	const char *p = base_filename(path);
+
+	while ((p = strstr(p, ".so"))) {
+		p += 3;
+		if (!*p || *p == '.') return 1;
+	}
+	return 0;
+}
+
+// The same as ldconfig_check_data(), but for symlink path, which is
+// taken for a shared object by its name.
+static
+void ldconfig_check_link(const char *path) {
+	const char *dir;
+
+	if (strcmp(opt_root, "") || !lib_dirs.head) return;
+	if (check_ld_so_conf(path)) return;
+	if (!(dir = lib_dir_of(path)) || !is_shared_object_name(path))
 		return;
 
+	pthread_mutex_lock(&ldconfig_lock);
+	add_lib_dir(&ldconfig_dirs, dir, strlen(dir));
+	pthread_mutex_unlock(&ldconfig_lock);
+	return;
+}
+
+// The same as ldconfig_check_data(), but reads ELF header of a file
+// which is about to be removed. fspath is the path to open, relative to
+// the directory dirfd. Symlinks are left to ldconfig_check_link().
+void ldconfig_check_at(int dirfd, const char *path, const char *fspath) {
+	unsigned char hdr[EI_NIDENT + 2];
+	ssize_t size;
+	int fd;
+
+	if (strcmp(opt_root, "") || !lib_dirs.head || check_ld_so_conf(path) ||
+	    !lib_dir_of(path))
+		return;
+	fd = openat(dirfd, fspath,
+	            O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ELOOP) ldconfig_check_link(path);
+		return;
+	}
+	size = read(fd, hdr, sizeof(hdr));
+	close(fd);
+	if (size > 0) ldconfig_check_data(path, hdr, size);
+	return;
+}
+
+void ldconfig_check_file(const char *path, const char *fspath) {
+	ldconfig_check_at(AT_FDCWD, path, fspath);
+	return;
+}
+
+static
+void exec_ldconfig(const char *const argv[]) {
 	pid_t child;
 	child = fork();
 
 	if (child == 0) {
-		execl("/sbin/ldconfig", "/sbin/ldconfig", (char*)NULL);
+		execv("/sbin/ldconfig", (char *const *)argv);
 		die("failed to execute /sbin/ldconfig");
 	}
 	else if (child == -1) die("can't fork()");
@@ -323,3 +796,63 @@ void run_ldconfig(void) {
 	}
 	return;
 }
+
+// Runs ldconfig if shared objects were installed or removed since the
+// last call. Meant to be called once, at the end of a transaction.
+void run_ldconfig(void) {
+	const char **argv;
+	size_t argc = 0;
+	int incremental = opt_ldconfig == LDCONFIG_INCREMENTAL;
+
+	if (!ldconfig_full && (!ldconfig_dirs.head || !ldconfig_dirs.size))
+		return;
+
+	// running ldconfig is meaningless when --root option specified
+	// because /sbin/ldconfig and /root/sbin/ldconfig could produce
+	// incompatible results. On the other hand /root/sbin/ldconfig
+	// may be infeasible for the host where pkgutils running, i.e.
+	// /root/sbin/ldconfig may be compiled for the different
+	// architecture, thus we can't blindly execute it.
+	if (strcmp(opt_root, ""))
+		goto done;
+
+	struct stat st;
+	if (stat("/sbin/ldconfig", &st))
+		goto done;
+
+	argv = fmalloc((ldconfig_dirs.size + 3) * sizeof(char *));
+	argv[argc++] = "/sbin/ldconfig";
+
+	// "ldconfig -n" only updates soname links in the given directories
+	// and leaves ld.so.cache alone, that's fine as long as the dynamic
+	// linker searches these directories without the cache
+	list_for_each(_dir, &ldconfig_dirs) {
+		int trusted = 0;
+		for (int i = 0; trusted_dirs[i]; i++)
+			if (!strcmp(_dir->data, trusted_dirs[i])) trusted = 1;
+		if (!trusted) incremental = 0;
+	}
+	if (ldconfig_full) incremental = 0;
+	if (incremental) {
+		argv[argc++] = "-n";
+		list_for_each(_dir, &ldconfig_dirs) {
+			char *dir = fmalloc(strlen(_dir->data) + 2);
+			dir[0] = '/';
+			strcpy(dir + 1, _dir->data);
+			argv[argc++] = dir;
+		}
+	}
+	argv[argc] = NULL;
+
+	exec_ldconfig(argv);
+	while (incremental && argc > 2) free((char *)argv[--argc]);
+	free(argv);
+done:
+	ldconfig_full = 0;
+	list_for_each(_dir, &ldconfig_dirs) {
+		free(_dir->data);
+		_dir = _dir->prev;
+		list_delete(&ldconfig_dirs, _dir->next);
+	}
+	return;
+}
@@ -19,9 +19,13 @@
 //  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
 //  USA.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <getopt.h>
 #include <pkgutils/pkgutils.h>
 #include "entry.h"
@@ -29,18 +33,62 @@
 static
 int opt_force;
 
+static
+const char *opt_name;
+
+static
+int opt_restore;
+
+static
+int opt_bootstrap;
+
+// files to extract with --extract
+static
+char **opt_extract;
+static
+int opt_nextract;
+
 static
 void print_usage(const char *argv0) {
-	printf("Usage: %s [-opfrhv] <package>\n", argv0);
+	printf("Usage: %s [-opflsSLnkbBdxrhv] <package>\n", argv0);
 	puts("  -o  --force-over    ignore database and filesystem conflicts\n"
 	     "  -p  --force-perms   ignore permissions conflicts\n"
 	     "  -f  --force         same as -o and -p together\n"
+	     "  -l  --ldconfig      ldconfig mode: full or incremental\n"
+	     "  -s  --sync          sync mode: none, package, batch or full\n"
+	     "  -S  --store <dir>   install files through content store\n"
+	     "  -L  --store-link    hard link files from the store\n"
+	     "  -n  --name <file>   package file name, when reading from stdin\n"
+	     "  -k  --keep-old <n>  keep up to n bytes of replaced versions\n"
+	     "  -b  --rollback      restore replaced versions of named packages\n"
+	     "  -B  --bootstrap     install all packages into empty root at once\n"
+	     "  -d  --defer         remove replaced files in the background\n"
+	     "  -x  --extract <f>   only extract file f from the package\n"
 	     "  -r  --root          specify alternate root\n"
 	     "  -h  --help          display this help\n"
 	     "  -v  --version       display version information");
 	return;
 }
 
+// Parses size with an optional K, M or G suffix. Returns -1 if it's
+// not valid.
+static
+off_t parse_size(const char *str) {
+	char *end;
+	off_t size;
+
+	errno = 0;
+	size = strtoll(str, &end, 10);
+	if (errno || end == str || size < 0) return -1;
+	switch (*end) {
+		case 'G': size <<= 10;
+		case 'M': size <<= 10;
+		case 'K': size <<= 10; end++; break;
+		default: break;
+	}
+	return *end ? -1 : size;
+}
+
 static
 void parse_opts(int argc, char *argv[]) {
 	int c;
@@ -49,18 +97,81 @@ void parse_opts(int argc, char *argv[]) {
 		{"force-perms", 0, NULL, 'p'},
 		{"force"      , 0, NULL, 'f'},
 		{"upgrade"    , 1, NULL, 'u'},
+		{"ldconfig"   , 1, NULL, 'l'},
+		{"sync"       , 1, NULL, 's'},
+		{"store"      , 1, NULL, 'S'},
+		{"store-link" , 0, NULL, 'L'},
+		{"name"       , 1, NULL, 'n'},
+		{"keep-old"   , 1, NULL, 'k'},
+		{"rollback"   , 0, NULL, 'b'},
+		{"bootstrap"  , 0, NULL, 'B'},
+		{"defer"      , 0, NULL, 'd'},
+		{"extract"    , 1, NULL, 'x'},
 		{"root"       , 1, NULL, 'r'},
 		{"help"       , 0, NULL, 'h'},
 		{"version"    , 0, NULL, 'v'},
 		{NULL         , 0, NULL, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "opfur:hv", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "opful:s:S:Ln:k:bBdx:r:hv", opts, NULL)) != -1) {
 		switch (c) {
 			case 'f': opt_force |= PKG_ADD_FORCE_PERM;
 			case 'o': opt_force |= PKG_ADD_FORCE; break;
 			case 'p': opt_force |= PKG_ADD_FORCE_PERM; break;
 			case 'u': break; // compatibility with C++ish pkgutils
+			case 'l':
+				if (!strcmp(optarg, "full"))
+					opt_ldconfig = LDCONFIG_FULL;
+				else if (!strcmp(optarg, "incremental"))
+					opt_ldconfig = LDCONFIG_INCREMENTAL;
+				else {
+					fprintf(stderr, "Unknown ldconfig mode: "
+					        "%s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				if (!strcmp(optarg, "none"))
+					opt_sync = PKG_SYNC_NONE;
+				else if (!strcmp(optarg, "package"))
+					opt_sync = PKG_SYNC_PACKAGE;
+				else if (!strcmp(optarg, "batch"))
+					opt_sync = PKG_SYNC_BATCH;
+				else if (!strcmp(optarg, "full"))
+					opt_sync = PKG_SYNC_FULL;
+				else {
+					fprintf(stderr, "Unknown sync mode: "
+					        "%s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'S':
+				// the store is shared between roots, and
+				// pkgadd works from within the root
+				if (mkdir(optarg, 0755) && errno != EEXIST)
+					die(optarg);
+				opt_store = realpath(optarg, NULL);
+				if (!opt_store) die(optarg);
+				break;
+			case 'L': opt_store_link = 1; break;
+			case 'n': opt_name = optarg; break;
+			case 'k':
+				opt_rollback = parse_size(optarg);
+				if (opt_rollback < 0) {
+					fprintf(stderr, "Invalid size: %s\n",
+					        optarg);
+					exit(1);
+				}
+				break;
+			case 'b': opt_restore = 1; break;
+			case 'B': opt_bootstrap = 1; break;
+			case 'd': opt_defer = 1; break;
+			case 'x':
+				if (!opt_extract)
+					opt_extract = fmalloc(argc *
+					                      sizeof(char *));
+				opt_extract[opt_nextract++] = optarg;
+				break;
 			case 'r': opt_root = optarg; break;
 			case 'h': print_usage(argv[0]); exit(0); break;
 			case 'v': pkgutils_version(); exit(0); break;
@@ -77,6 +188,15 @@ void parse_opts(int argc, char *argv[]) {
 	return;
 }
 
+// whether the installation was refused due to conflicts or errors
+static
+int failed(int found_conflicts) {
+	return (found_conflicts & CONFLICT_PERM &&
+	        !(opt_force & PKG_ADD_FORCE_PERM)) ||
+	       (found_conflicts & ~CONFLICT_PERM &&
+	        !(opt_force & PKG_ADD_FORCE));
+}
+
 int PKGADD_ENTRY(int argc, char *argv[]) {
 	int found_conflicts;
 
@@ -85,16 +205,45 @@ int PKGADD_ENTRY(int argc, char *argv[]) {
 
 	pkg_lock_db();
 	pkg_init_db();
+	if (opt_nextract) {
+		int missing = pkg_extract(argv[optind], opt_extract,
+		                          opt_nextract);
+		pkg_free_db();
+		pkg_unlock_db();
+		exit(missing ? 1 : 0);
+	}
+	if (opt_bootstrap) {
+		found_conflicts = pkg_bootstrap(argc - optind, argv + optind,
+		                                opt_force);
+		if (failed(found_conflicts)) {
+			pkg_end_transaction();
+			exit(1);
+		}
+		optind = argc;
+	}
 	while (optind < argc) {
-		found_conflicts = pkg_add(argv[optind], opt_force);
-		if (found_conflicts & CONFLICT_PERM &&
-		    !(opt_force & PKG_ADD_FORCE_PERM)) exit(1);
-		else if (found_conflicts & ~CONFLICT_PERM &&
-		         !(opt_force & PKG_ADD_FORCE)) exit(1);
+		if (opt_restore)
+			found_conflicts = pkg_rollback(argv[optind], opt_force);
+		else if (!strcmp(argv[optind], "-")) {
+			if (!opt_name) {
+				fprintf(stderr, "Package name is required "
+				        "to read from stdin\n");
+				pkg_end_transaction();
+				exit(1);
+			}
+			found_conflicts = pkg_add_fd(0, opt_name, opt_force);
+		}
+		else found_conflicts = pkg_add(argv[optind], opt_force);
+		if (failed(found_conflicts)) {
+			pkg_end_transaction();
+			exit(1);
+		}
 		optind++;
 	}
+	pkg_end_transaction();
 	pkg_free_db();
 	pkg_unlock_db();
+	unlink_reclaim(opt_root);
 
 	exit(0);
 	return 0;
@@ -22,41 +22,73 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
 #include <pwd.h>
 #include <grp.h>
 #include <regex.h>
 #include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include <pkgutils/pkgutils.h>
 #include "entry.h"
 
+// files pkginfo --size stats are split between threads in units of that
+// size
+#define SIZE_MAX_WORKERS 16
+#define SIZE_UNIT        256
+#define FOOTPRINT_MAX_WORKERS 16
+
 static
 int opt_installed,
     opt_orphans,
-    opt_missing;
+    opt_missing,
+    opt_cache,
+    opt_batch,
+    opt_null,
+    opt_size,
+    opt_live,
+    opt_watch;
 static
 char *opt_list,
      *opt_owner,
      *opt_footprint,
+     *opt_cat,
      *opt_orphans_pat = "^(dev|sys|proc|mnt|tmp|var|root|home|lost\\+found|"
                         "boot|etc|lib/modules|opt|usr/var|usr/src|usr/ports|"
                         "usr/local)";
 
+// the packages for --size, more archives for --footprint or the files
+// for --cat
+static
+char **operands;
+static
+int noperands;
+
 static
 void print_usage(const char *argv0) {
-	printf("Usage: %s [-ilofOmrhv]\n", argv0);
+	printf("Usage: %s [-ilofOmcbzsLCwrhv]\n", argv0);
 	puts("  -i  --installed           list installed packages\n"
 	     "  -l  --list <package|file> list files for file or package\n"
 	     "  -o  --owner <pattern>     print package owner\n"
 	     "  -f  --footprint <file>    print footprint for <file>\n"
 	     "  -O  --orphans=[pattern]   list orphaned files except pattern\n"
 	     "  -m  --missing             list missing files\n"
+	     "  -c  --cache               cache directory listings for -O and -m\n"
+	     "  -b  --batch               answer requests read from stdin\n"
+	     "  -z  --null                requests are separated by NUL\n"
+	     "  -s  --size [package ...]  print disk usage of packages\n"
+	     "  -L  --live                stat files for --size\n"
+	     "  -C  --cat <file> <path>   print file <path> of package <file>\n"
+	     "  -w  --watch               report missing and modified files\n"
 	     "  -r  --root                specify alternate root\n"
 	     "  -h  --help                display this help\n"
 	     "  -v  --version             display version information");
@@ -73,13 +105,20 @@ void parse_opts(int argc, char *argv[]) {
 		{"footprint",    1, NULL, 'f'},
 		{"orphans"  ,    2, NULL, 'O'},
 		{"missing"  ,    0, NULL, 'm'},
+		{"cache"    ,    0, NULL, 'c'},
+		{"batch"    ,    0, NULL, 'b'},
+		{"null"     ,    0, NULL, 'z'},
+		{"size"     ,    0, NULL, 's'},
+		{"live"     ,    0, NULL, 'L'},
+		{"cat"      ,    1, NULL, 'C'},
+		{"watch"    ,    0, NULL, 'w'},
 		{"root"     ,    1, NULL, 'r'},
 		{"help"     ,    0, NULL, 'h'},
 		{"version"  ,    0, NULL, 'v'},
 		{NULL       ,    0, NULL, 0}
 	};
 
-	while ((c = getopt_long(argc, argv,"il:o:f:O::mr:hv", opts,
+	while ((c = getopt_long(argc, argv,"il:o:f:O::mcbzsLC:wr:hv", opts,
 	                                                       NULL)) != -1) {
 		switch (c) {
 			case 'i': opt_installed = 1; break;
@@ -91,6 +130,13 @@ void parse_opts(int argc, char *argv[]) {
 				if (optarg) opt_orphans_pat = optarg;
 				break;
 			case 'm': opt_missing = 1; break;
+			case 'c': opt_cache = 1; break;
+			case 'b': opt_batch = 1; break;
+			case 'z': opt_null = 1; break;
+			case 's': opt_size = 1; break;
+			case 'L': opt_live = 1; break;
+			case 'C': opt_cat = optarg; break;
+			case 'w': opt_watch = 1; break;
 			case 'r': opt_root = optarg; break;
 			case 'h': print_usage(argv[0]); exit(0); break;
 			case 'v': pkgutils_version(); exit(0); break;
@@ -102,36 +148,181 @@ void parse_opts(int argc, char *argv[]) {
 		print_usage(argv[0]);
 		exit(1);
 	}
+	operands = argv + optind;
+	noperands = argc - optind;
 	return;
 }
 
+// Drops the database file at _file from its package if it's present.
+// Returns whether it did.
 static
-int missing(void) {
+int drop_present(list_entry_t *_file) {
+	pkg_file_t *file = _file->data;
 	struct stat st;
+
+	if (lstat(file->path, &st)) {
+		if (errno != ENOENT && errno != EACCES)
+			die(file->path);
+		return 0;
+	}
+	list_delete(&file->pkg->files, _file);
+	pkg_free_file(file);
+	return 1;
+}
+
+static
+size_t dir_len(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash ? (size_t)(slash - path) : 0;
+}
+
+// groups database files by directory, in the order of the scan cache
+static
+int parent_cmp(const void *a, const void *b) {
+	const char *patha = ((pkg_file_t *)(*(list_entry_t **)a)->data)->path;
+	const char *pathb = ((pkg_file_t *)(*(list_entry_t **)b)->data)->path;
+	size_t lena = dir_len(patha), lenb = dir_len(pathb);
+	int cmp = scan_dir_cmp(patha, lena, pathb, lenb);
+	return cmp ? cmp : strcmp(patha + lena, pathb + lenb);
+}
+
+static
+int name_cmp(const void *a, const void *b) {
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+// Reads entries of directory path in the format of the scan cache.
+// Returns NULL if it can't be read completely.
+static
+char *read_listing(const char *path) {
+	char *buf = NULL;
+	size_t len = 0, size = 0, name_len;
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	if (!(d = opendir(path))) return NULL;
+	errno = 0;
+	while ((de = readdir(d))) {
+		int is_dir = de->d_type == DT_DIR;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (de->d_type == DT_UNKNOWN &&
+		    !fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+			is_dir = S_ISDIR(st.st_mode);
+		name_len = strlen(de->d_name);
+		if (len + name_len + 3 > size) {
+			size = MAX(size * 2, len + name_len + 4096);
+			buf = realloc(buf, size);
+			if (!buf) die("realloc");
+		}
+		buf[len++] = is_dir ? 'd' : '-';
+		memcpy(buf + len, de->d_name, name_len + 1);
+		len += name_len + 1;
+	}
+	if (errno) {
+		free(buf);
+		buf = NULL;
+	}
+	else if (!buf) buf = strdup("");
+	else buf[len] = '\0';
+	closedir(d);
+	return buf;
+}
+
+// The same as dropping present files one by one, but directories whose
+// listing is cached and still valid are not looked into.
+static
+void drop_present_cached(scan_cache_t *cache) {
+	void **files;
+	size_t nfiles = 0, cnt = 0;
+
+	list_for_each(_pkg, &pkg_db)
+		nfiles += ((pkg_desc_t *)_pkg->data)->files.size;
+	files = fmalloc((nfiles ? nfiles : 1) * sizeof(void *));
+	list_for_each(_pkg, &pkg_db) {
+		pkg_desc_t *pkg = _pkg->data;
+		list_for_each(_file, &pkg->files) files[cnt++] = _file;
+	}
+	qsort(files, nfiles, sizeof(void *), parent_cmp);
+
+	for (size_t i = 0, j; i < nfiles; i = j) {
+		const char *path = ((pkg_file_t *)
+		                    ((list_entry_t *)files[i])->data)->path;
+		size_t len = dir_len(path), nnames = 0;
+		char *dir = strndup(path, len), *own = NULL;
+		const char *entries, **names;
+		struct stat st;
+
+		for (j = i + 1; j < nfiles; j++) {
+			const char *next = ((pkg_file_t *)
+			                    ((list_entry_t *)files[j])->data)->path;
+			if (scan_dir_cmp(path, len, next, dir_len(next))) break;
+		}
+
+		entries = NULL;
+		if (!stat(len ? dir : ".", &st) && S_ISDIR(st.st_mode)) {
+			entries = scan_cache_lookup(cache, dir, &st);
+			if (!entries) entries = own = read_listing(len ? dir : ".");
+		}
+		if (!entries) {
+			for (size_t k = i; k < j; k++) drop_present(files[k]);
+			free(dir);
+			continue;
+		}
+		scan_cache_put(cache, dir, &st, entries);
+
+		for (const char *p = entries; *p; p += strlen(p) + 1) nnames++;
+		names = fmalloc((nnames ? nnames : 1) * sizeof(char *));
+		nnames = 0;
+		for (const char *p = entries; *p; p += strlen(p) + 1)
+			names[nnames++] = p + 1;
+		qsort(names, nnames, sizeof(char *), name_cmp);
+
+		for (size_t k = i; k < j; k++) {
+			list_entry_t *_file = files[k];
+			pkg_file_t *file = _file->data;
+			const char *name = file->path + (len ? len + 1 : 0);
+			if (!bsearch(&name, names, nnames, sizeof(char *),
+			             name_cmp))
+				continue;
+			list_delete(&file->pkg->files, _file);
+			pkg_free_file(file);
+		}
+		free(names);
+		free(own);
+		free(dir);
+	}
+	free(files);
+	return;
+}
+
+static
+int missing(void) {
+	scan_cache_t *cache = NULL;
 	size_t width = 0;
 	pkg_desc_t *pkg;
 	pkg_file_t *file;
 
 	pkg_init_db();
+	if (opt_cache) cache = scan_cache_open("missing");
 	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
 		die("Can't chdir to root directory");
 
-	list_for_each(_pkg, &pkg_db) {
+	if (cache) {
+		drop_present_cached(cache);
+		scan_cache_close(cache);
+	}
+	else list_for_each(_pkg, &pkg_db) {
 		pkg = _pkg->data;
 		list_for_each(_file, &pkg->files) {
-			file = _file->data;
-			if (lstat(file->path, &st)) {
-				if (errno != ENOENT && errno != EACCES)
-					die(file->path);
-			}
-			else {
-				_file = _file->prev;
-				list_delete(&pkg->files, _file->next);
-				free(file->path);
-				free(file);
-			}
-
+			_file = _file->prev;
+			if (!drop_present(_file->next)) _file = _file->next;
 		}
+	}
+
+	list_for_each(_pkg, &pkg_db) {
+		pkg = _pkg->data;
 		if (pkg->files.size)
 			width = MAX(strlen(pkg->name), width);
 	}
@@ -149,135 +340,201 @@ int missing(void) {
 	return 0;
 }
 
-static size_t path_chop_len;
-static regex_t orphans_re;
-
+// If extended regular expression pat starts with a literal, returns its
+// character and moves pat to the last one of its bytes. Returns -1
+// otherwise.
 static
-void list_fs_files(const char *name, list_t *list) {
-	DIR *d;
-	struct dirent *de;
-	char path[MAXPATHLEN+2];
+int regex_literal(const char **pat) {
+	const char *p = *pat;
 
-	d = opendir(name);
-	if (!d) {
-		if (errno == EACCES) return;
-		else die(name);
-	}
-	
-	while ((de = readdir(d))) {
-		if (de->d_type == DT_DIR && (!strcmp(de->d_name, ".") ||
-		                             !strcmp(de->d_name, ".."))) {
-			continue;
-		}
-		strcpy(path, name);
-		strcat(path, "/");
-		strcat(path, de->d_name);
-		if (regexec(&orphans_re, path + path_chop_len, 0, NULL, 0)) {
-			pkg_file_t *file = fmalloc(sizeof(pkg_file_t));
-			file->path = strdup(path + path_chop_len);
-			list_append(list, file);
-			if (de->d_type == DT_DIR)
-				list_fs_files(path, list);
-		}
+	// glibc takes \< \> \` and \' for anchors, like \b and \w
+	if (*p == '\\' && p[1] && !isalnum((unsigned char)p[1]) &&
+	    !strchr("<>`'", p[1])) {
+		*pat = p + 1;
+		return (unsigned char)p[1];
 	}
-
-	closedir(d);
-	return;
+	if (!strchr("\\.[]()*+?{}^$|", *p)) return (unsigned char)*p;
+	return -1;
 }
 
+static regex_t orphans_re;
+
+// Literal prefixes the orphans pattern consists of, when it's an anchored
+// alternation of plain strings like the default one. Nothing under a
+// directory which none of them continues can match, so the entries there
+// are not tested.
+static list_t orphans_prefixes;
+
 static
-void list_db_files(list_t *list) {
-	list_for_each(_pkg, &pkg_db) {
-		pkg_desc_t *pkg = _pkg->data;
-		list_for_each(_file, &pkg->files) {
-			list_append(list, _file->data);
+int parse_prefixes(const char *pat) {
+	char *buf = fmalloc(strlen(pat) + 1), *p = buf;
+	int group;
+
+	list_init(&orphans_prefixes);
+	if (*pat++ != '^') goto fail;
+	if ((group = *pat == '(')) pat++;
+	for (;; pat++) {
+		int lit = regex_literal(&pat);
+
+		if (lit >= 0) *p++ = lit;
+		else if (*pat == '|' || (group && *pat == ')') ||
+		         (!group && !*pat)) {
+			*p = '\0';
+			if (p == buf) goto fail;
+			list_append(&orphans_prefixes, strdup(buf));
+			p = buf;
+			if (*pat != '|') break;
 		}
+		else goto fail;
 	}
-	return;
+	if (group && pat[1]) goto fail;
+	free(buf);
+	return 1;
+fail:
+	list_for_each(_prefix, &orphans_prefixes) free(_prefix->data);
+	list_free(&orphans_prefixes);
+	orphans_prefixes.head = NULL;
+	free(buf);
+	return 0;
 }
 
+// whether an entry under directory path can match the orphans pattern
 static
-void orphan_found(void **ai, void *arg) {
-	pkg_file_t *file = (*(list_entry_t**)ai)->data;
-	printf("%s/%s\n", opt_root, file->path);
-	return;
+int prefix_continues(const char *path) {
+	size_t len = strlen(path);
+
+	if (!orphans_prefixes.head) return 1;
+	list_for_each(_prefix, &orphans_prefixes) {
+		const char *prefix = _prefix->data;
+		if (!strncmp(prefix, path, len) && prefix[len] == '/')
+			return 1;
+	}
+	return 0;
 }
 
+// ctx tells whether the entries of the directory may match the pattern
 static
-void find_orphans(list_t *fs_files_list, list_t *db_files_list) {
-	void **fs_files, **db_files;
-	size_t fs_files_size = fs_files_list->size;
-	size_t db_files_size = db_files_list->size;
-	size_t cnt;
-
-	fs_files = fmalloc(fs_files_size * sizeof(void*));
-	cnt = 0;
-	list_for_each(_file, fs_files_list)
-		fs_files[cnt++] = _file;
+int orphans_filter(const char *path, int is_dir, int *ctx, void *arg) {
+	if (*ctx && !regexec(&orphans_re, path, 0, NULL, 0)) return 0;
+	if (is_dir && *ctx) *ctx = prefix_continues(path);
+	return 1;
+}
 
-	db_files = fmalloc(db_files_size * sizeof(void*));
-	cnt = 0;
-	list_for_each(_file, db_files_list)
-		db_files[cnt++] = _file;
+// database files sorted by path, and the first one not yet passed by the
+// walk
+typedef struct {
+	path_key_t *files;
+	size_t size;
+	size_t next;
+} db_view_t;
 
-	qsort(fs_files, fs_files_size, sizeof(void*), file_cmp);
-	qsort(db_files, db_files_size, sizeof(void*), file_cmp);
-	intersect_uniq(fs_files, fs_files_size, db_files, db_files_size,
-	               file_cmp, NULL, orphan_found, NULL);
+static
+void orphan_check(const char *path, int is_dir, void *arg) {
+	db_view_t *db = arg;
+	path_key_t key;
+	int cmp = 1;
 
-	free(fs_files);
-	free(db_files);
+	path_key_set(&key, path, NULL);
+	while (db->next < db->size) {
+		cmp = path_key_compare(&db->files[db->next], &key);
+		if (cmp >= 0) break;
+		db->next++;
+	}
+	if (cmp) printf("%s/%s\n", opt_root, path);
 	return;
 }
 
 static
 int orphans(void) {
-	list_t fs_files;
-	list_t db_files;
-	const char *opt_root2;
-	
+	scan_cache_t *cache = NULL;
+	db_view_t db;
+
 	if (regcomp(&orphans_re, opt_orphans_pat, REG_EXTENDED | REG_NOSUB)) {
 		fputs("Failed to compile regular expression\n", stderr);
 		return 1;
 	}
-	list_init(&fs_files);
-	list_init(&db_files);
 	pkg_init_db();
+	parse_prefixes(opt_orphans_pat);
 
-	opt_root2 = strcmp(opt_root, "") ? opt_root : "/";
-	path_chop_len = strlen(opt_root2) + 1;
-	
-	list_fs_files(opt_root2, &fs_files);
-	list_db_files(&db_files);
-
-	find_orphans(&fs_files, &db_files);
-
-	list_for_each(_file, &fs_files) {
-		pkg_file_t *file = _file->data;
-		_file = _file->prev;
-		list_delete(&fs_files, _file->next);
-		free(file->path);
-		free(file);
+	db.size = 0;
+	list_for_each(_pkg, &pkg_db)
+		db.size += ((pkg_desc_t *)_pkg->data)->files.size;
+	db.files = fmalloc((db.size ? db.size : 1) * sizeof(path_key_t));
+	db.next = 0;
+	list_for_each(_pkg, &pkg_db) {
+		pkg_desc_t *pkg = _pkg->data;
+		db.next += path_keys_add(db.files + db.next, &pkg->files);
 	}
-	list_free(&fs_files);
+	path_keys_sort(db.files, db.size);
+	db.next = 0;
 
-	list_for_each(_file, &db_files) {
-		_file = _file->prev;
-		list_delete(&db_files, _file->next);
-	}
-	list_free(&db_files);
+	// the walk comes in the same order, so orphans are found and
+	// printed as it goes
+	if (opt_cache) cache = scan_cache_open("orphans");
+	walk_tree(strcmp(opt_root, "") ? opt_root : "/", cache,
+	          orphans_filter, orphan_check, 1, &db);
+	if (cache) scan_cache_close(cache);
+
+	free(db.files);
 	pkg_free_db();
 	regfree(&orphans_re);
+	if (orphans_prefixes.head) {
+		list_for_each(_prefix, &orphans_prefixes) free(_prefix->data);
+		list_free(&orphans_prefixes);
+	}
 	return 0;
 }
 
+// user or group names, looked up once for all the archives
+typedef struct {
+	unsigned int id;
+	int group;
+	char *name;  // NULL if there is none
+} id_name_t;
+
+static id_name_t *id_names;
+static size_t nid_names;
+static pthread_mutex_t id_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Prints the name of user or group id to f, or the number if it has none
+static
+void put_id_name(FILE *f, unsigned int id, int group) {
+	const char *name = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&id_names_lock);
+	for (i = 0; i < nid_names; i++)
+		if (id_names[i].id == id && id_names[i].group == group) break;
+	if (i == nid_names) {
+		struct passwd *pw;
+		struct group *gr;
+
+		id_names = realloc(id_names, (i + 1) * sizeof(id_name_t));
+		if (!id_names) die("realloc");
+		id_names[i].id = id;
+		id_names[i].group = group;
+		id_names[i].name = NULL;
+		if (group && (gr = getgrgid(id)))
+			id_names[i].name = strdup(gr->gr_name);
+		else if (!group && (pw = getpwuid(id)))
+			id_names[i].name = strdup(pw->pw_name);
+		nid_names++;
+	}
+	// names never move, only the array does
+	name = id_names[i].name;
+	pthread_mutex_unlock(&id_names_lock);
+
+	if (name) fputs(name, f);
+	else fprintf(f, "%u", id);
+	return;
+}
+
 static
 void print_footprint(struct archive *ar, struct archive_entry *en,
-                     void *unused1, void *unused2) {
+                     void *_f, void *unused) {
+	FILE *f = _f;
 	struct stat st;
-	static char smode[11];
-	struct passwd *pw;
-	struct group *gr;
+	char smode[11];
 	
 	st.st_mode = archive_entry_mode(en);
 	st.st_uid = archive_entry_uid(en);
@@ -292,43 +549,288 @@ void print_footprint(struct archive *ar, struct archive_entry *en,
 		st.st_size = 1;
 	}
 
-	printf("%s\t", mode_string(st.st_mode, smode));
-
-	pw = getpwuid(st.st_uid);
-	if (pw) printf("%s/", pw->pw_name);
-	else printf("%d/", st.st_uid);
-
-	gr = getgrgid(st.st_gid);
-	if (gr) printf("%s\t", gr->gr_name);
-	else printf("%d\t", st.st_gid);
-
-	printf("%s", archive_entry_pathname(en));
+	fputs(mode_string(st.st_mode, smode), f);
+	fputc('\t', f);
+	put_id_name(f, st.st_uid, 0);
+	fputc('/', f);
+	put_id_name(f, st.st_gid, 1);
+	fputc('\t', f);
+	fputs(archive_entry_pathname(en), f);
 
 	if (S_ISLNK(st.st_mode)) {
-		printf(" -> %s", archive_entry_symlink(en));
+		fputs(" -> ", f);
+		fputs(archive_entry_symlink(en), f);
 	}
 	else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
-		printf(" (%d, %d)", (int)archive_entry_rdevmajor(en),
-		                    (int)archive_entry_rdevminor(en));
+		fprintf(f, " (%d, %d)", (int)archive_entry_rdevmajor(en),
+		                        (int)archive_entry_rdevminor(en));
 	}
 	else if (S_ISREG(st.st_mode) && !st.st_size) {
-		printf(" (EMPTY)");
+		fputs(" (EMPTY)", f);
 	}
 
-	puts("");
+	fputc('\n', f);
 	return;
 }
 
+// footprint of one archive, made by a worker and printed in order
+typedef struct {
+	const char *path;
+	char *out;
+	size_t size;
+	int ret;
+	int done;
+} footprint_job_t;
+
+static footprint_job_t *fp_jobs;
+static size_t fp_njobs;
+static size_t fp_next;
+static pthread_mutex_t fp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fp_done = PTHREAD_COND_INITIALIZER;
+
+static
+void make_footprint(footprint_job_t *job) {
+	FILE *f;
+
+	f = open_memstream(&job->out, &job->size);
+	if (!f) die("open_memstream");
+	if (!strchr(job->path, '#')) job->ret = 1;
+	else job->ret = do_manifest_once(job->path, print_footprint, f,
+	                                 NULL);
+	if (fclose(f)) die("Can't make footprint");
+	return;
+}
+
+static
+void *footprint_worker(void *arg) {
+	footprint_job_t *job;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&fp_lock);
+		job = fp_next < fp_njobs ? &fp_jobs[fp_next++] : NULL;
+		pthread_mutex_unlock(&fp_lock);
+		if (!job) break;
+
+		make_footprint(job);
+		pthread_mutex_lock(&fp_lock);
+		job->done = 1;
+		pthread_cond_broadcast(&fp_done);
+		pthread_mutex_unlock(&fp_lock);
+	}
+	return NULL;
+}
+
+// Prints the footprints of opt_footprint and the archives given after it.
+// They are made by the workers into memory and printed in the order of
+// the arguments, each under its name if there are several.
 static
 int footprint(void) {
-	if (!strchr(opt_footprint, '#')) return 1;
-	return do_archive_once(opt_footprint, print_footprint, NULL, NULL);
+	pthread_t workers[FOOTPRINT_MAX_WORKERS];
+	size_t nworkers = 0;
+	long ncpus;
+	int ret = 0;
+
+	fp_njobs = noperands + 1;
+	fp_jobs = fmalloc(fp_njobs * sizeof(footprint_job_t));
+	fp_jobs[0].path = opt_footprint;
+	for (size_t i = 1; i < fp_njobs; i++) fp_jobs[i].path = operands[i-1];
+	for (size_t i = 0; i < fp_njobs; i++) fp_jobs[i].done = 0;
+	fp_next = 0;
+
+	// the workers must not race to open the cache
+	manifest_init();
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < MIN(MIN(ncpus, FOOTPRINT_MAX_WORKERS),
+	                         (long)fp_njobs - 1); i++) {
+		if (pthread_create(&workers[i], NULL, footprint_worker, NULL))
+			break;
+		nworkers++;
+	}
+	// everything is done here if there are no workers
+	if (!nworkers) footprint_worker(NULL);
+
+	for (size_t i = 0; i < fp_njobs; i++) {
+		footprint_job_t *job = &fp_jobs[i];
+
+		pthread_mutex_lock(&fp_lock);
+		while (!job->done) pthread_cond_wait(&fp_done, &fp_lock);
+		pthread_mutex_unlock(&fp_lock);
+
+		if (fp_njobs > 1) printf("%s%s:\n", i ? "\n" : "", job->path);
+		fwrite(job->out, 1, job->size, stdout);
+		free(job->out);
+		if (job->ret) ret = 1;
+	}
+	for (size_t i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	free(fp_jobs);
+	return ret;
+}
+
+// state of --cat for one path
+typedef struct {
+	int found;
+	char *link;  // target of the hard link found
+} cat_t;
+
+static
+void cat_entry(struct archive *ar, struct archive_entry *en, void *_cat,
+               void *unused) {
+	cat_t *cat = _cat;
+	char buf[65536];
+	ssize_t len;
+
+	cat->found = 1;
+	if (archive_entry_hardlink(en)) {
+		cat->link = strdup(archive_entry_hardlink(en));
+		return;
+	}
+	if (!S_ISREG(archive_entry_mode(en))) {
+		fprintf(stderr, "%s is not a regular file\n",
+		        archive_entry_pathname(en));
+		cat->found = -1;
+		return;
+	}
+	while ((len = archive_read_data(ar, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, len, stdout);
+	if (len < 0) {
+		fprintf(stderr, "%s: %s\n", archive_entry_pathname(en),
+		        archive_error_string(ar));
+		cat->found = -1;
+	}
+	return;
+}
+
+// Prints the files of package opt_cat with the paths given after it.
+// Seekable packages are only inflated around them.
+static
+int cat(void) {
+	FILE *pkgf;
+	int ret = 0;
+
+	if (!noperands) {
+		fprintf(stderr, "File path is required for --cat\n");
+		return 1;
+	}
+	pkgf = fopen(opt_cat, "r");
+	if (!pkgf) {
+		fprintf(stderr, "Can't open %s: %s\n", opt_cat,
+		        strerror(errno));
+		return 1;
+	}
+	for (int i = 0; i < noperands; i++) {
+		cat_t cat = { 0, NULL };
+		char *path = operands[i];
+
+		if (do_archive_paths(pkgf, &path, 1, cat_entry, &cat, NULL))
+			cat.found = -1;
+		// hard links have no data of their own
+		if (cat.link) {
+			path = cat.link;
+			cat.found = 0;
+			cat.link = NULL;
+			if (do_archive_paths(pkgf, &path, 1, cat_entry, &cat,
+			                     NULL))
+				cat.found = -1;
+			free(cat.link);
+			free(path);
+		}
+		if (!cat.found)
+			fprintf(stderr, "%s: not found in %s\n", operands[i],
+			        opt_cat);
+		if (cat.found != 1) ret = 1;
+	}
+	fclose(pkgf);
+	return ret;
+}
+
+// Skips the bracket expression at p, returns its closing ']'
+static
+const char *skip_bracket(const char *p) {
+	p++;
+	if (*p == '^') p++;
+	// the first ']' is literal
+	if (*p == ']') p++;
+	while (*p && *p != ']') {
+		// [:class:], [.coll.] and [=equiv=] may contain ']'
+		if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+			char c = p[1];
+			for (p += 2; *p && !(*p == c && p[1] == ']'); p++);
+			if (*p) p++;
+		}
+		if (*p) p++;
+	}
+	return p;
+}
+
+// Finds the longest string every match of extended regular expression
+// pat contains, or returns NULL. *exact is set if the pattern is just
+// that string. Only literals outside groups and brackets are considered.
+static
+char *required_literal(const char *pat, int *exact) {
+	char *run = fmalloc(strlen(pat) + 1), *best = NULL;
+	size_t len = 0, best_len = 0;
+	int depth = 0;
+
+	*exact = 1;
+	for (const char *p = pat; *p; p++) {
+		int lit = regex_literal(&p);
+
+		if (lit < 0 || depth) {
+			*exact = 0;
+			// alternatives have no common part we'd know of
+			if (*p == '|' && !depth) {
+				best_len = len = 0;
+				break;
+			}
+			else if (*p == '\\' && p[1]) p++;
+			else if (*p == '(') depth++;
+			else if (*p == ')' && depth) depth--;
+			else if (*p == '[') {
+				p = skip_bracket(p);
+				if (!*p) break;
+			}
+		}
+		// a quantified character is not required
+		else if (p[1] == '*' || p[1] == '?' || p[1] == '{')
+			*exact = 0;
+		else {
+			run[len++] = lit;
+			if (p[1] != '+') continue;
+			*exact = 0;
+			p++;
+		}
+
+		if (len > best_len) {
+			free(best);
+			run[len] = '\0';
+			best = strdup(run);
+			best_len = len;
+		}
+		len = 0;
+	}
+	if (len > best_len) {
+		free(best);
+		run[len] = '\0';
+		best = strdup(run);
+		best_len = len;
+	}
+	free(run);
+	if (best_len < 2) {
+		free(best);
+		best = NULL;
+		*exact = 0;
+	}
+	return best;
 }
 
 static
 int owner(void) {
-	int ret = 1;
-	size_t width = 0;
+	int ret = 1, exact;
+	size_t width = 0, literal_len = 0;
+	char *literal;
 	regex_t re;
 	list_t files;
 	
@@ -338,6 +840,10 @@ int owner(void) {
 		fputs("Failed to compile regular expression\n", stderr);
 		return 1;
 	}
+	// most patterns are plain substrings, and memmem() is much faster
+	// than regexec() at turning down the rest of the paths
+	literal = required_literal(opt_owner, &exact);
+	if (literal) literal_len = strlen(literal);
 	
 	list_init(&files);
 	pkg_init_db();
@@ -345,7 +851,12 @@ int owner(void) {
 		pkg_desc_t *pkg = _pkg->data;
 		list_for_each(_file, &pkg->files) {
 			pkg_file_t *file = _file->data;
-			if (regexec(&re, file->path, 0, 0, 0)) continue;
+			if (literal &&
+			    !memmem(file->path, strlen(file->path), literal,
+			            literal_len))
+				continue;
+			if (!exact && regexec(&re, file->path, 0, 0, 0))
+				continue;
 			list_append(&files, file);
 			width = MAX(strlen(pkg->name), width);
 		}
@@ -357,7 +868,9 @@ int owner(void) {
 		printf("%-*s %s\n", width, file->pkg->name, file->path);
 	}
 
+	free(literal);
 	list_free(&files);
+	regfree(&re);
 	pkg_free_db();
 	return ret;
 }
@@ -369,24 +882,29 @@ void list_ar_files(struct archive *ar, struct archive_entry *en, void *unused1,
 	return;
 }
 
+static
+void print_file(const char *name, pkg_file_t *file) {
+	if (name) printf("%s ", name);
+	printf("%s", file->path);
+	S_ISDIR(file->mode) ? puts("/") : puts("");
+	return;
+}
+
 static
 int list(void) {
 	int ret = 1;
 	pkg_desc_t *pkg;
 
 	if (strchr(opt_list, '#')) {
-		ret = do_archive_once(opt_list, list_ar_files, NULL, NULL);
+		ret = do_manifest_once(opt_list, list_ar_files, NULL, NULL);
 		return ret;
 	}
 
 	pkg_init_db();
 	if ((pkg = pkg_find_pkg(opt_list)) != NULL) {
 		ret = 0;
-		list_for_each(_file, &pkg->files) {
-			pkg_file_t *file = _file->data;
-			printf("%s", file->path);
-			S_ISDIR(file->mode) ? puts("/") : puts("");
-		}
+		list_for_each(_file, &pkg->files)
+			print_file(NULL, _file->data);
 	}
 	pkg_free_db();
 	if (ret) fprintf(stderr, "\"%s\" is neither an installed package nor "
@@ -407,6 +925,615 @@ int installed(void) {
 	return 0;
 }
 
+// database files sorted by path, for the owner requests of batch()
+static void **batch_files;
+static size_t batch_nfiles;
+
+static
+int path_cmp(const void *key, const void *b) {
+	pkg_file_t *file = (*(list_entry_t **)b)->data;
+	return strcmp(key, file->path);
+}
+
+// Prints the packages owning path, which may have leading and trailing
+// slashes.
+static
+void batch_owner(char *path) {
+	size_t len, lo = 0, hi = batch_nfiles;
+
+	while (*path == '/') path++;
+	len = strlen(path);
+	while (len && path[len-1] == '/') path[--len] = '\0';
+
+	// the first of the files with that path
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (path_cmp(path, &batch_files[mid]) > 0) lo = mid + 1;
+		else hi = mid;
+	}
+	for (; lo < batch_nfiles && !path_cmp(path, &batch_files[lo]); lo++) {
+		pkg_file_t *file = (*(list_entry_t **)&batch_files[lo])->data;
+		print_file(file->pkg->name, file);
+	}
+	return;
+}
+
+// Answers requests read from stdin, one per line or, with --null, per
+// NUL terminated string, with the database loaded once:
+//   owner <file>      packages owning the file
+//   list <package>    files of the package
+//   installed         installed packages and their versions
+//   exists <package>  the package and its version, if it's installed
+// Every answer ends with an empty line.
+static
+int batch(void) {
+	int delim = opt_null ? '\0' : '\n';
+	char *line = NULL, *arg;
+	size_t size = 0, cnt = 0;
+	struct stat st;
+	int flush;
+	ssize_t len;
+	pkg_desc_t *pkg;
+
+	pkg_init_db();
+	list_for_each(_pkg, &pkg_db)
+		batch_nfiles += ((pkg_desc_t *)_pkg->data)->files.size;
+	batch_files = fmalloc((batch_nfiles ? batch_nfiles : 1) *
+	                      sizeof(void *));
+	list_for_each(_pkg, &pkg_db) {
+		pkg = _pkg->data;
+		list_for_each(_file, &pkg->files) batch_files[cnt++] = _file;
+	}
+	qsort(batch_files, batch_nfiles, sizeof(void *), file_cmp);
+
+	// whoever writes the requests to a pipe may wait for the answers
+	flush = fstat(0, &st) || !S_ISREG(st.st_mode);
+
+	while ((len = getdelim(&line, &size, delim, stdin)) > 0) {
+		if (line[len-1] == delim) line[--len] = '\0';
+		if ((arg = strchr(line, ' '))) *arg++ = '\0';
+
+		if (!strcmp(line, "owner") && arg)
+			batch_owner(arg);
+		else if (!strcmp(line, "list") && arg) {
+			if ((pkg = pkg_find_pkg(arg)))
+				list_for_each(_file, &pkg->files)
+					print_file(NULL, _file->data);
+			else
+				fprintf(stderr, "Package \"%s\" is not "
+				        "installed\n", arg);
+		}
+		else if (!strcmp(line, "installed") && !arg)
+			list_for_each(_pkg, &pkg_db) {
+				pkg = _pkg->data;
+				printf("%s %s\n", pkg->name, pkg->version);
+			}
+		else if (!strcmp(line, "exists") && arg) {
+			if ((pkg = pkg_find_pkg(arg)))
+				printf("%s %s\n", pkg->name, pkg->version);
+		}
+		else if (len)
+			fprintf(stderr, "Invalid request: %s\n", line);
+		else continue;
+		putchar('\n');
+		if (flush) fflush(stdout);
+	}
+
+	free(line);
+	free(batch_files);
+	pkg_free_db();
+	return 0;
+}
+
+// a file of the packages --size reports on
+typedef struct {
+	pkg_file_t *file;
+	off_t size;
+	dev_t dev;
+	ino_t ino;
+} usage_t;
+
+static usage_t **stat_queue;
+static size_t stat_nqueued;
+static size_t stat_next;
+static int stat_root = -1;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void *stat_worker(void *arg) {
+	struct stat st;
+	size_t start, end;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&stat_lock);
+		start = stat_next;
+		stat_next = end = MIN(start + SIZE_UNIT, stat_nqueued);
+		pthread_mutex_unlock(&stat_lock);
+		if (start == end) break;
+
+		for (size_t i = start; i < end; i++) {
+			usage_t *u = stat_queue[i];
+			u->size = 0;
+			if (fstatat(stat_root, u->file->path, &st,
+			            AT_SYMLINK_NOFOLLOW) || !S_ISREG(st.st_mode))
+				continue;
+			u->size = st.st_size;
+			u->dev = st.st_dev;
+			u->ino = st.st_ino;
+		}
+	}
+	return NULL;
+}
+
+// Takes the sizes of the queued files from the file system, files which
+// are absent or not regular take no space.
+static
+void stat_files(void) {
+	pthread_t workers[SIZE_MAX_WORKERS];
+	size_t nworkers = 0;
+
+	stat_root = open(strcmp(opt_root, "") ? opt_root : "/",
+	                 O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (stat_root < 0) die("Can't open root directory");
+
+	// stat() is bound by latency when the inodes aren't cached, so more
+	// threads than processors are used. The caller works as well.
+	stat_next = 0;
+	for (size_t i = 0; i < MIN(stat_nqueued / SIZE_UNIT,
+	                           SIZE_MAX_WORKERS); i++) {
+		if (pthread_create(&workers[i], NULL, stat_worker, NULL))
+			break;
+		nworkers++;
+	}
+	stat_worker(NULL);
+	for (size_t i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	close(stat_root);
+	stat_root = -1;
+	return;
+}
+
+// ties are broken by the order of the packages, so the first one owning
+// a file gets its size
+static
+int usage_path_cmp(const void *a, const void *b) {
+	const usage_t *ua = *(usage_t *const *)a, *ub = *(usage_t *const *)b;
+	int ret = strcmp(ua->file->path, ub->file->path);
+	if (ret) return ret;
+	return ua < ub ? -1 : ua > ub;
+}
+
+static
+int usage_inode_cmp(const void *a, const void *b) {
+	const usage_t *ua = *(usage_t *const *)a, *ub = *(usage_t *const *)b;
+	if (ua->dev != ub->dev) return ua->dev < ub->dev ? -1 : 1;
+	if (ua->ino != ub->ino) return ua->ino < ub->ino ? -1 : 1;
+	return ua < ub ? -1 : ua > ub;
+}
+
+// Leaves the size of the files sorted by cmpf only to the first of the
+// equal ones.
+static
+void count_once(usage_t **arr, size_t n,
+                int (*cmpf)(const void *, const void *),
+                int (*eqf)(const usage_t *, const usage_t *)) {
+	qsort(arr, n, sizeof(usage_t *), cmpf);
+	for (size_t i = 1; i < n; i++)
+		if (eqf(arr[i-1], arr[i])) arr[i]->size = 0;
+	return;
+}
+
+static
+int same_path(const usage_t *a, const usage_t *b) {
+	return !strcmp(a->file->path, b->file->path);
+}
+
+static
+int same_inode(const usage_t *a, const usage_t *b) {
+	return a->dev == b->dev && a->ino == b->ino;
+}
+
+// Prints the space taken by the data of the regular files of packages,
+// the ones given or all of them. The sizes recorded at installation are
+// used, files are stat'ed if they are unknown or with --live. Hard links
+// and the paths owned by several packages are counted once, for the
+// first package.
+static
+int size(void) {
+	pkg_desc_t **pkgs;
+	usage_t *usage, **arr;
+	size_t npkgs = 0, nfiles = 0, cnt = 0, nlinked = 0;
+	intmax_t total = 0;
+	int ret = 0;
+
+	pkg_init_db();
+	pkgs = fmalloc((pkg_db.size + noperands + 1) * sizeof(pkg_desc_t *));
+	if (noperands) {
+		for (int i = 0; i < noperands; i++) {
+			pkg_desc_t *pkg = pkg_find_pkg(operands[i]);
+			if (pkg) pkgs[npkgs++] = pkg;
+			else {
+				fprintf(stderr, "Package \"%s\" is not "
+				        "installed\n", operands[i]);
+				ret = 1;
+			}
+		}
+	}
+	else list_for_each(_pkg, &pkg_db) pkgs[npkgs++] = _pkg->data;
+
+	for (size_t i = 0; i < npkgs; i++) nfiles += pkgs[i]->files.size;
+	usage = fmalloc((nfiles ? nfiles : 1) * sizeof(usage_t));
+	arr = fmalloc((nfiles ? nfiles : 1) * sizeof(usage_t *));
+	stat_queue = fmalloc((nfiles ? nfiles : 1) * sizeof(usage_t *));
+	stat_nqueued = 0;
+	for (size_t i = 0; i < npkgs; i++) {
+		list_for_each(_file, &pkgs[i]->files) {
+			usage_t *u = &usage[cnt];
+			u->file = _file->data;
+			u->size = S_ISDIR(u->file->mode) ? 0 : u->file->size;
+			u->dev = 0;
+			u->ino = 0;
+			arr[cnt++] = u;
+			if (!S_ISDIR(u->file->mode) &&
+			    (opt_live || u->size < 0))
+				stat_queue[stat_nqueued++] = u;
+		}
+	}
+	if (stat_nqueued) stat_files();
+
+	count_once(arr, nfiles, usage_path_cmp, same_path);
+	for (size_t i = 0; i < nfiles; i++)
+		if (usage[i].ino && usage[i].size) arr[nlinked++] = &usage[i];
+	count_once(arr, nlinked, usage_inode_cmp, same_inode);
+
+	cnt = 0;
+	for (size_t i = 0; i < npkgs; i++) {
+		intmax_t pkg_size = 0;
+		for (size_t j = 0; j < pkgs[i]->files.size; j++)
+			pkg_size += usage[cnt++].size;
+		printf("%s %jd\n", pkgs[i]->name, pkg_size);
+		total += pkg_size;
+	}
+	if (npkgs > 1) printf("total %jd\n", total);
+
+	free(stat_queue);
+	free(arr);
+	free(usage);
+	free(pkgs);
+	pkg_free_db();
+	return ret;
+}
+
+// a file of the database under --watch
+typedef struct {
+	pkg_file_t *file;
+	int missing;
+	int modified;
+} watched_file_t;
+
+// A directory holding files of the database or their directories.
+// Symlinks to directories are followed, so several of them may share a
+// watch.
+typedef struct {
+	char *path;  // "" for the root
+	int wd;      // -1 if it's not watched
+	int next;    // index of the next one with the same watch, or -1
+} watched_dir_t;
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR | \
+                    IN_EXCL_UNLINK)
+
+static watched_file_t *wfiles;
+static size_t nwfiles;
+static watched_dir_t *wdirs;
+static size_t nwdirs;
+static int *wd_dirs;  // first index of wdirs by watch descriptor
+static size_t nwd_dirs;
+static int inotify_fd;
+
+static
+void report(const char *event, watched_file_t *wf) {
+	printf("%s %s %s\n", event, wf->file->pkg->name, wf->file->path);
+	return;
+}
+
+// Reports what changed about wf, present or not, changed is set when
+// something was written to it.
+static
+void update_file(watched_file_t *wf, int present, int changed) {
+	if (!present) {
+		if (!wf->missing) report("missing", wf);
+		wf->missing = 1;
+	}
+	else if (wf->missing) {
+		report("restored", wf);
+		wf->missing = 0;
+	}
+	else if (changed && !wf->modified) {
+		report("modified", wf);
+		wf->modified = 1;
+	}
+	return;
+}
+
+static
+int wfile_cmp(const void *a, const void *b) {
+	const watched_file_t *wa = a, *wb = b;
+	return strcmp(wa->file->path, wb->file->path);
+}
+
+static
+int wdir_cmp(const void *a, const void *b) {
+	return strcmp(((const watched_dir_t *)a)->path,
+	              ((const watched_dir_t *)b)->path);
+}
+
+// whether path is prefix or lies under it, "" is the root
+static
+int under(const char *path, const char *prefix, size_t len) {
+	return !len || (!strncmp(path, prefix, len) &&
+	                (!path[len] || path[len] == '/'));
+}
+
+// index of the first file with path not less than prefix
+static
+size_t first_file(const char *prefix) {
+	size_t lo = 0, hi = nwfiles;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(wfiles[mid].file->path, prefix) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static
+size_t first_dir(const char *prefix) {
+	size_t lo = 0, hi = nwdirs;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (strcmp(wdirs[mid].path, prefix) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Checks the files at prefix and under it, paths sharing the prefix
+// follow each other.
+static
+void rescan(const char *prefix) {
+	size_t len = strlen(prefix);
+	struct stat st;
+
+	for (size_t i = first_file(prefix); i < nwfiles; i++) {
+		const char *path = wfiles[i].file->path;
+		if (len && strncmp(path, prefix, len)) break;
+		if (!under(path, prefix, len)) continue;
+		update_file(&wfiles[i], !lstat(path, &st), 0);
+	}
+	return;
+}
+
+// Checks the files with exactly that path
+static
+void check_path(const char *path, int changed) {
+	struct stat st;
+	int present = -1;
+
+	for (size_t i = first_file(path);
+	     i < nwfiles && !strcmp(wfiles[i].file->path, path); i++) {
+		if (present < 0) present = !lstat(path, &st);
+		update_file(&wfiles[i], present, changed);
+	}
+	return;
+}
+
+// Watches the directories at prefix and under it which are not watched
+// yet and exist.
+static
+void add_watches(const char *prefix) {
+	size_t len = strlen(prefix);
+	int wd;
+
+	for (size_t i = first_dir(prefix); i < nwdirs; i++) {
+		watched_dir_t *dir = &wdirs[i];
+		if (len && strncmp(dir->path, prefix, len)) break;
+		if (!under(dir->path, prefix, len) || dir->wd >= 0) continue;
+
+		wd = inotify_add_watch(inotify_fd, *dir->path ? dir->path : ".",
+		                       WATCH_MASK);
+		if (wd < 0) {
+			if (errno != ENOENT && errno != ENOTDIR)
+				fprintf(stderr, "Can't watch %s/%s: %s\n",
+				        opt_root, dir->path, strerror(errno));
+			continue;
+		}
+		if ((size_t)wd >= nwd_dirs) {
+			size_t n = MAX(nwd_dirs * 2, (size_t)wd + 1);
+			wd_dirs = realloc(wd_dirs, n * sizeof(int));
+			if (!wd_dirs) die("realloc");
+			for (size_t j = nwd_dirs; j < n; j++) wd_dirs[j] = -1;
+			nwd_dirs = n;
+		}
+		dir->next = wd_dirs[wd];
+		wd_dirs[wd] = i;
+		dir->wd = wd;
+	}
+	return;
+}
+
+// Stops watching the directories at prefix and under it, which were
+// removed or moved away. Watches follow the moved directories, and are
+// kept while other paths lead to them.
+static
+void remove_watches(const char *prefix) {
+	size_t len = strlen(prefix);
+
+	for (size_t i = first_dir(prefix); i < nwdirs; i++) {
+		watched_dir_t *dir = &wdirs[i];
+		int *link;
+
+		if (len && strncmp(dir->path, prefix, len)) break;
+		if (!under(dir->path, prefix, len) || dir->wd < 0) continue;
+		for (link = &wd_dirs[dir->wd]; *link != (int)i;
+		     link = &wdirs[*link].next);
+		*link = dir->next;
+		if (wd_dirs[dir->wd] < 0) inotify_rm_watch(inotify_fd, dir->wd);
+		dir->wd = -1;
+	}
+	return;
+}
+
+static
+void add_dir(size_t *size, const char *path, size_t len) {
+	if (nwdirs == *size) {
+		*size = *size ? *size * 2 : 256;
+		wdirs = realloc(wdirs, *size * sizeof(watched_dir_t));
+		if (!wdirs) die("realloc");
+	}
+	wdirs[nwdirs].path = strndup(path, len);
+	if (!wdirs[nwdirs].path) die("strndup");
+	wdirs[nwdirs].wd = -1;
+	wdirs[nwdirs].next = -1;
+	nwdirs++;
+	return;
+}
+
+// Collects the files of the database and the directories to watch: the
+// root, the directories of the database and all their parents.
+static
+void collect_watched(void) {
+	const char *prev = "", *path, *slash;
+	size_t size = 0, cnt = 0, common, j;
+
+	list_for_each(_pkg, &pkg_db)
+		nwfiles += ((pkg_desc_t *)_pkg->data)->files.size;
+	wfiles = fmalloc((nwfiles ? nwfiles : 1) * sizeof(watched_file_t));
+	list_for_each(_pkg, &pkg_db) {
+		pkg_desc_t *pkg = _pkg->data;
+		list_for_each(_file, &pkg->files) {
+			wfiles[cnt].file = _file->data;
+			wfiles[cnt].missing = 0;
+			wfiles[cnt].modified = 0;
+			cnt++;
+		}
+	}
+	qsort(wfiles, nwfiles, sizeof(watched_file_t), wfile_cmp);
+
+	add_dir(&size, "", 0);
+	for (size_t i = 0; i < nwfiles; i++) {
+		path = wfiles[i].file->path;
+		// the parents shared with the previous path are already there
+		for (common = j = 0; path[j] && path[j] == prev[j]; j++)
+			if (path[j] == '/') common = j + 1;
+		for (slash = strchr(path + common, '/'); slash;
+		     slash = strchr(slash + 1, '/'))
+			add_dir(&size, path, slash - path);
+		if (S_ISDIR(wfiles[i].file->mode))
+			add_dir(&size, path, strlen(path));
+		prev = path;
+	}
+
+	qsort(wdirs, nwdirs, sizeof(watched_dir_t), wdir_cmp);
+	for (size_t i = cnt = 1; i < nwdirs; i++) {
+		if (!strcmp(wdirs[i].path, wdirs[cnt-1].path))
+			free(wdirs[i].path);
+		else wdirs[cnt++] = wdirs[i];
+	}
+	nwdirs = cnt;
+	return;
+}
+
+// Handles event ev in directory dir
+static
+void handle_dir_event(watched_dir_t *dir, struct inotify_event *ev) {
+	char path[MAXPATHLEN+1];
+
+	snprintf(path, sizeof(path), "%s%s%s", dir->path,
+	         *dir->path ? "/" : "", ev->name);
+	// symlinks to directories come and go like files
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) remove_watches(path);
+	if (ev->mask & (IN_CREATE | IN_MOVED_TO)) add_watches(path);
+	// a file put in place of another one, like editors save them
+	if (ev->mask & (IN_CLOSE_WRITE | IN_ATTRIB) ||
+	    (ev->mask & IN_MOVED_TO && !(ev->mask & IN_ISDIR)))
+		check_path(path, 1);
+	if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+		rescan(path);
+	return;
+}
+
+static
+void handle_event(struct inotify_event *ev) {
+	if (ev->mask & IN_Q_OVERFLOW) {
+		// events are lost, everything is checked again
+		add_watches("");
+		rescan("");
+		return;
+	}
+	if (ev->wd < 0 || (size_t)ev->wd >= nwd_dirs || wd_dirs[ev->wd] < 0)
+		return;
+	if (ev->mask & IN_IGNORED) {
+		for (int i = wd_dirs[ev->wd]; i >= 0; i = wdirs[i].next)
+			wdirs[i].wd = -1;
+		wd_dirs[ev->wd] = -1;
+		return;
+	}
+	// the parent reports about the directory itself
+	if (!ev->len) return;
+
+	for (int i = wd_dirs[ev->wd], next; i >= 0; i = next) {
+		next = wdirs[i].next;
+		handle_dir_event(&wdirs[i], ev);
+	}
+	return;
+}
+
+// Reports the files of the database which are missing, then keeps
+// watching the directories holding them, and reports the files as they
+// go missing, are restored or modified, one "<event> <package> <file>"
+// line each. Directories are watched with inotify, so only the changes
+// made while it runs are noticed as modifications.
+static
+int watch(void) {
+	// aligned for the events
+	union {
+		char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+		struct inotify_event ev;
+	} events;
+	char *buf = events.buf;
+	ssize_t len;
+
+	pkg_init_db();
+	if (chdir(strcmp(opt_root, "") ? opt_root : "/"))
+		die("Can't chdir to root directory");
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd < 0) die("inotify_init1");
+
+	collect_watched();
+	// watches first, so nothing changed in between goes unnoticed
+	add_watches("");
+	rescan("");
+	fflush(stdout);
+
+	while ((len = read(inotify_fd, buf, sizeof(events.buf))) > 0 ||
+	       (len < 0 && errno == EINTR)) {
+		for (char *p = buf; len > 0 && p < buf + len;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			handle_event(ev);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+		fflush(stdout);
+	}
+	die("Can't read file system events");
+	return 1;
+}
+
 int PKGINFO_ENTRY(int argc, char *argv[]) {
 	int ret = 1;
 	opt_root = "";
@@ -418,6 +1545,10 @@ int PKGINFO_ENTRY(int argc, char *argv[]) {
 	else if (opt_footprint) ret = footprint();
 	else if (opt_orphans) ret = orphans();
 	else if (opt_missing) ret = missing();
+	else if (opt_batch) ret = batch();
+	else if (opt_size) ret = size();
+	else if (opt_cat) ret = cat();
+	else if (opt_watch) ret = watch();
 	else print_usage(argv[0]);
 
 	exit(ret);
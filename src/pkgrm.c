@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <pkgutils/pkgutils.h>
@@ -28,8 +29,10 @@
 
 static
 void print_usage(const char *argv0) {
-	printf("Usage: %s [-rhv] <package>\n", argv0);
-	puts("  -r  --root      specify alternate root\n"
+	printf("Usage: %s [-lsrhv] <package> ...\n", argv0);
+	puts("  -l  --ldconfig  ldconfig mode: full or incremental\n"
+	     "  -s  --sync      sync mode: none, package, batch or full\n"
+	     "  -r  --root      specify alternate root\n"
 	     "  -h  --help      display this help\n"
 	     "  -v  --version   display version information");
 	return;
@@ -39,14 +42,42 @@ static
 void parse_opts(int argc, char *argv[]) {
 	int c;
 	struct option opts[] = {
-		{"root"   , 1, NULL, 'r'},
-		{"help"   , 0, NULL, 'h'},
-		{"version", 0, NULL, 'v'},
-		{NULL  , 0, NULL, 0}
+		{"ldconfig", 1, NULL, 'l'},
+		{"sync"    , 1, NULL, 's'},
+		{"root"    , 1, NULL, 'r'},
+		{"help"    , 0, NULL, 'h'},
+		{"version" , 0, NULL, 'v'},
+		{NULL      , 0, NULL, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "r:hv", opts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "l:s:r:hv", opts, NULL)) != -1) {
 		switch (c) {
+			case 'l':
+				if (!strcmp(optarg, "full"))
+					opt_ldconfig = LDCONFIG_FULL;
+				else if (!strcmp(optarg, "incremental"))
+					opt_ldconfig = LDCONFIG_INCREMENTAL;
+				else {
+					fprintf(stderr, "Unknown ldconfig mode: "
+					        "%s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 's':
+				if (!strcmp(optarg, "none"))
+					opt_sync = PKG_SYNC_NONE;
+				else if (!strcmp(optarg, "package"))
+					opt_sync = PKG_SYNC_PACKAGE;
+				else if (!strcmp(optarg, "batch"))
+					opt_sync = PKG_SYNC_BATCH;
+				else if (!strcmp(optarg, "full"))
+					opt_sync = PKG_SYNC_FULL;
+				else {
+					fprintf(stderr, "Unknown sync mode: "
+					        "%s\n", optarg);
+					exit(1);
+				}
+				break;
 			case 'r': opt_root = optarg; break;
 			case 'h': print_usage(argv[0]); exit(0); break;
 			case 'v': pkgutils_version(); exit(0); break;
@@ -69,12 +100,11 @@ int PKGRM_ENTRY(int argc, char *argv[]) {
 
 	pkg_lock_db();
 	pkg_init_db();
-	while (optind < argc) {
-		pkg_rm(argv[optind]);
-		optind++;
-	}
+	pkg_rm_pkgs(argc - optind, argv + optind);
+	pkg_end_transaction();
 	pkg_free_db();
 	pkg_unlock_db();
+	unlink_reclaim(opt_root);
 
 	exit(0);
 	return 0;
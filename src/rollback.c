@@ -0,0 +1,243 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Rollback cache. Before an upgrade removes or overwrites the files of
+// the old version, they are hard linked into a snapshot, which is kept
+// relative to the root as ROLLBACK_DIR/<name>: the database record of the
+// old version in "record" and its files under "files". Restoring the
+// snapshot is then a matter of renames. Snapshots are evicted, oldest
+// first, when together they take more than opt_rollback bytes.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pkgutils/pkgutils.h>
+
+// relative to the root, as pkg_add() works from within it
+#define ROLLBACK_DIR     "."LOCALSTATEDIR"/lib/pkg/rollback"
+#define ROLLBACK_RECORD  "/record"
+#define ROLLBACK_FILES   "/files"
+
+off_t opt_rollback;
+
+typedef struct {
+	char *name;
+	time_t mtime;
+	off_t size;
+} snapshot_t;
+
+static off_t tree_size;
+
+// Returns 0 if snprintf() into a MAXPATHLEN+1 bytes buffer returned len,
+// -1 with errno set if it truncated the path.
+static
+int path_fits(int len) {
+	if (len >= 0 && len <= MAXPATHLEN) return 0;
+	errno = ENAMETOOLONG;
+	return -1;
+}
+
+static
+int snapshot_path(char *buf, const char *name, const char *suffix) {
+	return path_fits(snprintf(buf, MAXPATHLEN+1, "%s/%s%s", ROLLBACK_DIR,
+	                          name, suffix));
+}
+
+// Stores the path of file path in snapshot dir in buf of MAXPATHLEN+1
+// bytes. Returns -1 if it's too long.
+int rollback_path(char *buf, const char *dir, const char *path) {
+	return path_fits(snprintf(buf, MAXPATHLEN+1, "%s" ROLLBACK_FILES "/%s",
+	                          dir, path));
+}
+
+// Hard links the files of old_pkg which are about to be removed or
+// overwritten into its snapshot, replacing the previous one. Files still
+// owned by other packages are left out. Must be called after conflicts
+// are found, and before the old files are removed.
+void rollback_save(pkg_desc_t *old_pkg) {
+	char dir[MAXPATHLEN+1], tmp[MAXPATHLEN+1], path[MAXPATHLEN+1];
+	struct stat st;
+	FILE *f;
+
+	if (snapshot_path(dir, old_pkg->name, "") ||
+	    snapshot_path(tmp, old_pkg->name, ".new") ||
+	    snapshot_path(path, old_pkg->name, ".new" ROLLBACK_FILES "/")) {
+		fprintf(stderr, "Can't keep %s for rollback: %s\n",
+		        old_pkg->name, strerror(errno));
+		return;
+	}
+	remove_tree(tmp);
+	make_parents(path);
+	// old setuid binaries are not reachable for users through it
+	chmod(ROLLBACK_DIR, 0700);
+
+	list_for_each(_file, &old_pkg->files) {
+		pkg_file_t *file = _file->data;
+		if (file->conflict == CONFLICT_REF) continue;
+		if (lstat(file->path, &st)) continue;
+
+		if (rollback_path(path, tmp, file->path)) goto failed;
+		if (S_ISDIR(st.st_mode) ? !mkdir(path, 0700) || errno == EEXIST :
+		                          !link(file->path, path))
+			continue;
+		if (errno != ENOENT) goto failed;
+		make_parents(path);
+		if (S_ISDIR(st.st_mode) ? mkdir(path, 0700) :
+		                          link(file->path, path))
+			goto failed;
+	}
+
+	// directories get their permissions when nothing is added to them
+	list_for_each_r(_file, &old_pkg->files) {
+		pkg_file_t *file = _file->data;
+		if (!S_ISDIR(file->mode) || file->conflict == CONFLICT_REF ||
+		    lstat(file->path, &st) || !S_ISDIR(st.st_mode))
+			continue;
+		if (rollback_path(path, tmp, file->path)) goto failed;
+		if (chown(path, st.st_uid, st.st_gid) ||
+		    chmod(path, st.st_mode & 07777))
+			goto failed;
+	}
+
+	if (path_fits(snprintf(path, sizeof(path), "%s" ROLLBACK_RECORD, tmp)))
+		goto failed;
+	f = fopen(path, "w");
+	if (!f) goto failed;
+	pkg_write_desc(f, old_pkg);
+	if (fclose(f)) goto failed;
+
+	remove_tree(dir);
+	if (rename(tmp, dir)) goto failed;
+	return;
+failed:
+	fprintf(stderr, "Can't keep %s for rollback: %s: %s\n", old_pkg->name,
+	        path, strerror(errno));
+	remove_tree(tmp);
+	return;
+}
+
+// Loads the snapshot of package name. Its directory is stored in dir.
+// Returns NULL if there is none.
+pkg_desc_t *rollback_load(const char *name, char *dir) {
+	char path[MAXPATHLEN+1];
+	pkg_desc_t *pkg = NULL;
+	list_t pkgs;
+	FILE *f;
+
+	if (snapshot_path(dir, name, "") ||
+	    snapshot_path(path, name, ROLLBACK_RECORD))
+		return NULL;
+	f = fopen(path, "r");
+	if (!f) return NULL;
+
+	list_init(&pkgs);
+	pkg_read_desc(f, &pkgs);
+	fclose(f);
+	list_for_each(_pkg, &pkgs) {
+		if (!pkg) pkg = _pkg->data;
+		else pkg_free_desc(_pkg->data);
+	}
+	list_free(&pkgs);
+	return pkg;
+}
+
+static
+int add_size(const char *path, const struct stat *st, int flag,
+             struct FTW *ftw) {
+	// Every file counts, even those still linked from the root: the
+	// cache is evicted before the new version replaces them, and they
+	// are given back once it does.
+	if (flag == FTW_F) tree_size += st->st_blocks * 512;
+	return 0;
+}
+
+static
+int snapshot_cmp(const void *a, const void *b) {
+	const snapshot_t *sa = *(snapshot_t**)a, *sb = *(snapshot_t**)b;
+	if (sa->mtime != sb->mtime) return sa->mtime < sb->mtime ? 1 : -1;
+	return strcmp(sa->name, sb->name);
+}
+
+// Removes the oldest snapshots until the rest fit into opt_rollback
+void rollback_evict(void) {
+	char path[MAXPATHLEN+1];
+	snapshot_t **snaps, *snap;
+	struct dirent *de;
+	struct stat st;
+	list_t list;
+	off_t total = 0;
+	size_t i;
+	DIR *d;
+
+	d = opendir(ROLLBACK_DIR);
+	if (!d) return;
+	list_init(&list);
+	while ((de = readdir(d))) {
+		size_t len = strlen(de->d_name);
+
+		// the ones being saved
+		if (de->d_name[0] == '.' || (len > 4 &&
+		    !strcmp(de->d_name + len - 4, ".new")))
+			continue;
+		if (snapshot_path(path, de->d_name, ROLLBACK_RECORD) ||
+		    stat(path, &st))
+			continue;
+
+		snapshot_path(path, de->d_name, ROLLBACK_FILES);
+		tree_size = 0;
+		nftw(path, add_size, 16, FTW_PHYS);
+
+		snap = fmalloc(sizeof(snapshot_t));
+		snap->name = fmalloc(strlen(de->d_name) + 1);
+		strcpy(snap->name, de->d_name);
+		snap->mtime = st.st_mtime;
+		snap->size = tree_size;
+		list_append(&list, snap);
+	}
+	closedir(d);
+
+	snaps = fmalloc(list.size * sizeof(snapshot_t*) + 1);
+	i = 0;
+	list_for_each(_snap, &list) snaps[i++] = _snap->data;
+
+	// newest first
+	qsort(snaps, list.size, sizeof(snapshot_t*), snapshot_cmp);
+	for (i = 0; i < list.size; i++) {
+		total += snaps[i]->size;
+		if (total > opt_rollback) {
+			dbg("evicting %s from rollback cache\n", snaps[i]->name);
+			snapshot_path(path, snaps[i]->name, "");
+			remove_tree(path);
+		}
+		free(snaps[i]->name);
+		free(snaps[i]);
+	}
+	free(snaps);
+	list_free(&list);
+	return;
+}
@@ -0,0 +1,220 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Cache of directory listings for pkginfo scans, relative to the root in
+// SCAN_DIR/<name>. A listing is valid while the directory keeps its inode
+// number, modification and change times. It holds every entry, whatever
+// the scan filters out, so it doesn't depend on the database or on the
+// patterns of the scan. Directories changed within the last second
+// before the scan are not cached, as their further changes could keep
+// the times.
+//
+// The file starts with SCAN_HEADER, then for every directory there are
+// "ino mtime mtime_nsec ctime ctime_nsec " in hex, the path, NUL, and the
+// entries: 'd' for directories or '-' for the rest, then the name, NUL.
+// The entries end with an empty one. Directories are written in the
+// order of scan_dir_cmp(), as both scans visit them.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pkgutils/pkgutils.h>
+
+#define SCAN_DIR    LOCALSTATEDIR"/cache/pkg/scan"
+#define SCAN_HEADER "pkgutils-scan 1\n"
+
+typedef struct {
+	const char *path;
+	unsigned long long ino;
+	long long mtime, mtime_nsec, ctime, ctime_nsec;
+	const char *entries;
+} record_t;
+
+struct scan_cache {
+	char *data;  // the old cache
+	size_t size;
+	record_t *records;
+	size_t nrecords;
+	char *path;
+	char *new_path;  // the new one, renamed to path when complete
+	FILE *out;
+	time_t start;
+};
+
+// Compares directory paths as if they ended with '/', which is the
+// order of their contents in a sorted list of paths. The root, "", goes
+// first.
+int scan_dir_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+	size_t n = MIN(alen, blen);
+	unsigned char ca, cb;
+	int cmp;
+
+	if (!alen || !blen) return !!alen - !!blen;
+	if ((cmp = memcmp(a, b, n))) return cmp;
+	ca = n < alen ? a[n] : '/';
+	cb = n < blen ? b[n] : '/';
+	if (ca != cb) return ca - cb;
+	return alen < blen ? -1 : alen > blen;
+}
+
+static
+int record_cmp(const void *a, const void *b) {
+	const record_t *ra = a, *rb = b;
+	return scan_dir_cmp(ra->path, strlen(ra->path),
+	                    rb->path, strlen(rb->path));
+}
+
+// Indexes the records of the old cache. A damaged one is ignored.
+static
+int load(scan_cache_t *cache) {
+	char *p = cache->data, *end = cache->data + cache->size;
+	size_t size = 0, sorted = 1;
+
+	if (cache->size < sizeof(SCAN_HEADER) - 1 || end[-1] != '\0' ||
+	    memcmp(p, SCAN_HEADER, sizeof(SCAN_HEADER) - 1))
+		return -1;
+	p += sizeof(SCAN_HEADER) - 1;
+
+	while (p < end) {
+		record_t *rec;
+		char *next;
+
+		if (cache->nrecords == size) {
+			size = MAX(size * 2, 1024);
+			cache->records = realloc(cache->records,
+			                         size * sizeof(record_t));
+			if (!cache->records) die("realloc");
+		}
+		rec = &cache->records[cache->nrecords];
+		rec->ino = strtoull(p, &next, 16);
+		rec->mtime = strtoll(next, &next, 16);
+		rec->mtime_nsec = strtoll(next, &next, 16);
+		rec->ctime = strtoll(next, &next, 16);
+		rec->ctime_nsec = strtoll(next, &next, 16);
+		if (*next != ' ') return -1;
+		rec->path = next + 1;
+		// the file ends with NUL, so strings can't run past it
+		p = (char *)rec->path + strlen(rec->path) + 1;
+		rec->entries = p;
+		while (p < end && *p) p += strlen(p) + 1;
+		if (p++ >= end) return -1;
+		if (cache->nrecords && record_cmp(rec - 1, rec) >= 0)
+			sorted = 0;
+		cache->nrecords++;
+	}
+	if (!sorted)
+		qsort(cache->records, cache->nrecords, sizeof(record_t),
+		      record_cmp);
+	return 0;
+}
+
+// Opens the cache name, and starts writing its new version. Returns NULL
+// if it's not available at all.
+scan_cache_t *scan_cache_open(const char *name) {
+	scan_cache_t *cache = fmalloc(sizeof(scan_cache_t));
+	char path[MAXPATHLEN+1];
+	struct stat st;
+	int fd;
+
+	memset(cache, 0, sizeof(scan_cache_t));
+	cache->start = time(NULL);
+	snprintf(path, sizeof(path), "%s%s/%s", opt_root, SCAN_DIR, name);
+	make_parents(path);
+	cache->path = strdup(path);
+	// scans may run at the same time
+	cache->new_path = fmalloc(strlen(path) + 32);
+	sprintf(cache->new_path, "%s.%ld", path, (long)getpid());
+	cache->out = fopen(cache->new_path, "w");
+	if (cache->out) fputs(SCAN_HEADER, cache->out);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && !fstat(fd, &st) && st.st_size > 0) {
+		cache->size = st.st_size;
+		cache->data = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE,
+		                   fd, 0);
+		if (cache->data == MAP_FAILED) cache->data = NULL;
+		else if (load(cache)) cache->nrecords = 0;
+	}
+	if (fd >= 0) close(fd);
+
+	if (!cache->out && !cache->nrecords) {
+		scan_cache_close(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+// Returns the cached entries of directory path described by st, in the
+// format of the file, or NULL. Safe to call from several threads.
+const char *scan_cache_lookup(scan_cache_t *cache, const char *path,
+                              const struct stat *st) {
+	record_t key, *rec;
+
+	key.path = path;
+	rec = bsearch(&key, cache->records, cache->nrecords, sizeof(record_t),
+	              record_cmp);
+	if (!rec || rec->ino != st->st_ino ||
+	    rec->mtime != st->st_mtim.tv_sec ||
+	    rec->mtime_nsec != st->st_mtim.tv_nsec ||
+	    rec->ctime != st->st_ctim.tv_sec ||
+	    rec->ctime_nsec != st->st_ctim.tv_nsec)
+		return NULL;
+	return rec->entries;
+}
+
+// Writes entries of directory path described by st to the new cache.
+// Must be called from one thread, in the order of scan_dir_cmp().
+void scan_cache_put(scan_cache_t *cache, const char *path,
+                    const struct stat *st, const char *entries) {
+	const char *p = entries;
+
+	if (!cache->out || st->st_mtim.tv_sec >= cache->start - 1 ||
+	    st->st_ctim.tv_sec >= cache->start - 1)
+		return;
+	while (*p) p += strlen(p) + 1;
+	fprintf(cache->out, "%llx %llx %lx %llx %lx %s",
+	        (unsigned long long)st->st_ino,
+	        (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+	        (long long)st->st_ctim.tv_sec, st->st_ctim.tv_nsec, path);
+	fputc('\0', cache->out);
+	fwrite(entries, 1, p - entries + 1, cache->out);
+	return;
+}
+
+// Replaces the old cache with the new one, if it was written completely.
+void scan_cache_close(scan_cache_t *cache) {
+	if (cache->out && (fclose(cache->out) ||
+	                   rename(cache->new_path, cache->path)))
+		unlink(cache->new_path);
+	if (cache->data) munmap(cache->data, cache->size);
+	free(cache->records);
+	free(cache->path);
+	free(cache->new_path);
+	free(cache);
+	return;
+}
@@ -0,0 +1,290 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Seekable packages, written by pkgmk -sk, are gzip members of whole tar
+// entries, so inflating may start at any member. The end of the archive
+// is followed by two more members, ignored by tar: the index, a
+// "pkgutils-index 1" line then "<member offset>\t<path>" line for every
+// entry, and a "pkgutils-index-offset <offset>" line pointing to it.
+// Other packages are just read through.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pkgutils/pkgutils.h>
+
+#define INDEX_HEADER    "pkgutils-index 1\n"
+#define INDEX_TAIL      "pkgutils-index-offset "
+// the last member is looked for that far from the end
+#define INDEX_TAIL_MAX  128
+// bigger indexes are ignored
+#define INDEX_MAX_SIZE  (64 << 20)
+
+typedef struct {
+	off_t offset;  // of the member holding the entry
+	char *path;    // without the trailing slash
+} index_entry_t;
+
+typedef struct {
+	char **paths;  // wanted ones, sorted
+	size_t npaths;
+	index_entry_t *index;
+	size_t nindex;
+	off_t frame;   // member being read, if there is an index
+	int done;      // set when the member is left
+	do_archive_fun_t func;
+	void *arg1;
+	void *arg2;
+} lookup_t;
+
+// the path without leading and trailing slashes
+static
+char *normalize(const char *path) {
+	char *tmp;
+	size_t len;
+
+	while (*path == '/') path++;
+	tmp = strdup(path);
+	if (!tmp) die("strdup");
+	len = strlen(tmp);
+	while (len && tmp[len-1] == '/') tmp[--len] = '\0';
+	return tmp;
+}
+
+static
+int str_cmp(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static
+int index_cmp(const void *a, const void *b) {
+	return strcmp(((const index_entry_t *)a)->path,
+	              ((const index_entry_t *)b)->path);
+}
+
+static
+int offset_cmp(const void *a, const void *b) {
+	off_t oa = *(const off_t *)a, ob = *(const off_t *)b;
+	return oa < ob ? -1 : oa > ob;
+}
+
+// Inflates the gzip members in [start, end) of the package into a NUL
+// terminated buffer. Returns NULL if they don't inflate to at most max
+// bytes.
+static
+char *inflate_members(unsigned char *map, size_t start, size_t end,
+                      size_t max, size_t *size) {
+	struct archive *ar;
+	struct archive_entry *en;
+	char *buf;
+	ssize_t ret;
+
+	if (end - start < 18 || map[start] != 0x1f || map[start+1] != 0x8b)
+		return NULL;
+	ar = archive_read_new();
+	if (!ar) die("archive_read_new");
+	archive_read_support_compression_gzip(ar);
+	archive_read_support_format_raw(ar);
+	if (archive_read_open_memory(ar, map + start, end - start) !=
+	    ARCHIVE_OK || archive_read_next_header(ar, &en) != ARCHIVE_OK) {
+		archive_read_finish(ar);
+		return NULL;
+	}
+
+	buf = fmalloc(max + 1);
+	*size = 0;
+	while ((ret = archive_read_data(ar, buf + *size, max + 1 - *size)) > 0)
+		if ((*size += ret) > max) break;
+	archive_read_finish(ar);
+	if (ret < 0 || *size > max) {
+		free(buf);
+		return NULL;
+	}
+	buf[*size] = '\0';
+	return buf;
+}
+
+// Reads the index of the mapped package, sorted by path. Returns NULL if
+// there is none.
+static
+index_entry_t *read_index(unsigned char *map, size_t size, size_t *nindex) {
+	index_entry_t *index;
+	char *tail = NULL, *buf, *line, *end, *tab;
+	size_t pos, len, cnt = 0;
+	long long offset = -1;
+
+	// the tail member comes last, it's found by its header
+	for (pos = size > INDEX_TAIL_MAX ? size - INDEX_TAIL_MAX : 0;
+	     pos + 18 <= size; pos++) {
+		if (map[pos] != 0x1f || map[pos+1] != 0x8b || map[pos+2] != 8)
+			continue;
+		tail = inflate_members(map, pos, size, 64, &len);
+		if (tail && !strncmp(tail, INDEX_TAIL, sizeof(INDEX_TAIL) - 1))
+			break;
+		free(tail);
+		tail = NULL;
+	}
+	if (!tail) return NULL;
+	offset = strtoll(tail + sizeof(INDEX_TAIL) - 1, NULL, 10);
+	free(tail);
+	if (offset < 0 || (size_t)offset >= pos) return NULL;
+
+	buf = inflate_members(map, offset, pos, INDEX_MAX_SIZE, &len);
+	if (!buf) return NULL;
+	if (strncmp(buf, INDEX_HEADER, sizeof(INDEX_HEADER) - 1)) {
+		free(buf);
+		return NULL;
+	}
+
+	for (line = buf; *line; line++) if (*line == '\n') cnt++;
+	index = fmalloc((cnt ? cnt : 1) * sizeof(index_entry_t));
+	cnt = 0;
+	for (line = buf + sizeof(INDEX_HEADER) - 1; *line; line = end + 1) {
+		if (!(end = strchr(line, '\n')) || !(tab = strchr(line, '\t')) ||
+		    tab > end)
+			break;
+		*end = *tab = '\0';
+		index[cnt].offset = strtoll(line, NULL, 10);
+		index[cnt].path = normalize(tab + 1);
+		cnt++;
+	}
+	free(buf);
+	qsort(index, cnt, sizeof(index_entry_t), index_cmp);
+	*nindex = cnt;
+	return index;
+}
+
+static
+index_entry_t *find_entry(lookup_t *lk, char *path) {
+	index_entry_t key = { 0, path };
+	return bsearch(&key, lk->index, lk->nindex, sizeof(index_entry_t),
+	               index_cmp);
+}
+
+static
+void check_entry(struct archive *ar, struct archive_entry *en, void *_lk,
+                 void *unused) {
+	lookup_t *lk = _lk;
+	char *path;
+	index_entry_t *e;
+
+	if (lk->done) return;
+	path = normalize(archive_entry_pathname(en));
+	// an entry of the next member
+	if (lk->index && (!(e = find_entry(lk, path)) ||
+	                  e->offset != lk->frame)) {
+		lk->done = 1;
+		free(path);
+		return;
+	}
+	// embedded manifest is not a part of the package
+	if (strcmp(path, PKG_MANIFEST) &&
+	    bsearch(&path, lk->paths, lk->npaths, sizeof(char *), str_cmp))
+		lk->func(ar, en, lk->arg1, lk->arg2);
+	free(path);
+	return;
+}
+
+// Reads entries from the member at offset on, until the member is left.
+static
+int read_frame(lookup_t *lk, unsigned char *map, size_t size, off_t offset) {
+	struct archive *ar;
+	struct archive_entry *en;
+	int err = 0;
+
+	ar = archive_read_new();
+	if (!ar) die("archive_read_new");
+	archive_read_support_compression_gzip(ar);
+	archive_read_support_format_tar(ar);
+	if (archive_read_open_memory(ar, map + offset, size - offset) !=
+	    ARCHIVE_OK) {
+		fprintf(stderr, "%s\n", archive_error_string(ar));
+		archive_read_finish(ar);
+		return -1;
+	}
+
+	lk->frame = offset;
+	lk->done = 0;
+	while (!lk->done) {
+		err = archive_read_next_header(ar, &en);
+		if (err != ARCHIVE_OK) break;
+		check_entry(ar, en, lk, NULL);
+	}
+	if (err == ARCHIVE_EOF || lk->done) err = 0;
+	else {
+		fprintf(stderr, "%s\n", archive_error_string(ar));
+		err = -1;
+	}
+	archive_read_finish(ar);
+	return err;
+}
+
+// Calls func for the entries of package pkg with the given paths, which
+// may have leading and trailing slashes. Only the gzip members holding
+// them are inflated if the package is seekable. Returns 0 if succeeded,
+// whether or not all the paths are found.
+int do_archive_paths(FILE *pkg, char *paths[], size_t npaths,
+                     do_archive_fun_t func, void *arg1, void *arg2) {
+	lookup_t lk = { NULL, npaths, NULL, 0, 0, 0, func, arg1, arg2 };
+	unsigned char *map = NULL;
+	off_t *offsets;
+	size_t noffsets = 0;
+	struct stat st;
+	int err = 0;
+
+	lk.paths = fmalloc((npaths ? npaths : 1) * sizeof(char *));
+	for (size_t i = 0; i < npaths; i++) lk.paths[i] = normalize(paths[i]);
+	qsort(lk.paths, npaths, sizeof(char *), str_cmp);
+
+	if (!fstat(fileno(pkg), &st) && S_ISREG(st.st_mode) && st.st_size) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+		           fileno(pkg), 0);
+		if (map == MAP_FAILED) map = NULL;
+	}
+	if (map) lk.index = read_index(map, st.st_size, &lk.nindex);
+
+	if (!lk.index) err = do_archive(pkg, check_entry, &lk, NULL);
+	else {
+		offsets = fmalloc((npaths ? npaths : 1) * sizeof(off_t));
+		for (size_t i = 0; i < npaths; i++) {
+			index_entry_t *e = find_entry(&lk, lk.paths[i]);
+			if (e) offsets[noffsets++] = e->offset;
+		}
+		qsort(offsets, noffsets, sizeof(off_t), offset_cmp);
+		for (size_t i = 0; i < noffsets && !err; i++) {
+			if (i && offsets[i] == offsets[i-1]) continue;
+			if (offsets[i] >= st.st_size) break;
+			err = read_frame(&lk, map, st.st_size, offsets[i]);
+		}
+		free(offsets);
+		for (size_t i = 0; i < lk.nindex; i++) free(lk.index[i].path);
+		free(lk.index);
+	}
+
+	if (map) munmap(map, st.st_size);
+	for (size_t i = 0; i < npaths; i++) free(lk.paths[i]);
+	free(lk.paths);
+	return err;
+}
@@ -0,0 +1,363 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Content addressed store. Every regular file extracted with the store
+// enabled is kept as <store>/objects/xx/yyyy..., named by SHA-256 of its
+// data, and is then reflinked, hard linked or copied into the root. A
+// per-archive index (<store>/index/<package file name>) maps paths to
+// objects, so installing the same package into another root does not
+// need to write any file data at all.
+//
+// Hard linked objects share their inode with the installed files, thus
+// in that mode mode and ownership are part of the object name too.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <pkgutils/pkgutils.h>
+#include <pkgutils/sha256.h>
+
+#define STORE_OBJECTS "/objects/"
+#define STORE_INDEX   "/index/"
+#define STORE_TMP     "/tmp/"
+// hex digest, and "-mode-uid-gid" in link mode
+#define REF_MAX       (SHA256_DIGEST_SIZE * 2 + 40)
+
+char *opt_store;
+int opt_store_link;
+
+typedef struct {
+	char *path;
+	char *ref;
+} index_entry_t;
+
+static index_entry_t *pkg_index;
+static size_t pkg_index_size;
+static char *pkg_index_path;
+// archive identity the index was built for
+static off_t pkg_size;
+static time_t pkg_mtime;
+
+static
+int index_cmp(const void *a, const void *b) {
+	return strcmp(((const index_entry_t *)a)->path,
+	              ((const index_entry_t *)b)->path);
+}
+
+static
+char *store_path(const char *dir, const char *name) {
+	char *path = fmalloc(strlen(opt_store) + strlen(dir) +
+	                     strlen(name) + 2);
+	strcpy(path, opt_store);
+	strcat(path, dir);
+	if (!strcmp(dir, STORE_OBJECTS)) {
+		// objects are spread over 256 subdirectories
+		strncat(path, name, 2);
+		strcat(path, "/");
+		name += 2;
+	}
+	strcat(path, name);
+	return path;
+}
+
+static
+void read_index(void) {
+	char line[MAXPATHLEN + REF_MAX + 2];
+	long long size, mtime;
+	size_t alloc = 0;
+	char *path;
+	FILE *f;
+
+	f = fopen(pkg_index_path, "r");
+	if (!f) return;
+	if (!fgets(line, sizeof(line), f) ||
+	    sscanf(line, "%lld %lld", &size, &mtime) != 2 ||
+	    size != pkg_size || mtime != pkg_mtime) {
+		// index of another archive with the same name
+		fclose(f);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(path = strchr(line, ' '))) continue;
+		*path++ = '\0';
+		if (pkg_index_size == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			pkg_index = realloc(pkg_index,
+			                    alloc * sizeof(index_entry_t));
+			if (!pkg_index) die("realloc");
+		}
+		pkg_index[pkg_index_size].path = strdup(path);
+		pkg_index[pkg_index_size].ref = strdup(line);
+		pkg_index_size++;
+	}
+	fclose(f);
+	qsort(pkg_index, pkg_index_size, sizeof(index_entry_t), index_cmp);
+	return;
+}
+
+// Prepares the store for installing pkgf, loads its index if any.
+void store_begin(FILE *pkgf, const char *pkg_path) {
+	static const char *dirs[] = { STORE_OBJECTS, STORE_INDEX, STORE_TMP,
+	                              NULL };
+	struct stat st;
+	char *dir;
+
+	for (int i = 0; dirs[i]; i++) {
+		dir = fmalloc(strlen(opt_store) + strlen(dirs[i]) + 1);
+		strcpy(dir, opt_store);
+		strcat(dir, dirs[i]);
+		if (mkdir(dir, 0755) && errno != EEXIST) die(dir);
+		free(dir);
+	}
+
+	if (fstat(fileno(pkgf), &st)) die(pkg_path);
+	pkg_size = st.st_size;
+	pkg_mtime = st.st_mtime;
+	pkg_index_path = store_path(STORE_INDEX, base_filename(pkg_path));
+	pkg_index = NULL;
+	pkg_index_size = 0;
+	read_index();
+	return;
+}
+
+// Returns the object path should be installed from, or NULL if the file
+// data has to be read from the archive.
+const char *store_lookup(const char *path) {
+	index_entry_t key = { (char *)path, NULL }, *found;
+	char *obj;
+	int ret;
+
+	found = bsearch(&key, pkg_index, pkg_index_size,
+	                sizeof(index_entry_t), index_cmp);
+	if (!found) return NULL;
+	obj = store_path(STORE_OBJECTS, found->ref);
+	ret = access(obj, F_OK);
+	free(obj);
+	return ret ? NULL : found->ref;
+}
+
+static
+void make_ref(char *ref, sha256_ctx_t *ctx, struct archive_entry *en) {
+	unsigned char digest[SHA256_DIGEST_SIZE];
+
+	sha256_final(ctx, digest);
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(ref + 2*i, "%02x", digest[i]);
+	if (opt_store_link)
+		sprintf(ref + 2*SHA256_DIGEST_SIZE, "-%o-%u-%u",
+		        (unsigned)archive_entry_mode(en) & 07777,
+		        (unsigned)archive_entry_uid(en),
+		        (unsigned)archive_entry_gid(en));
+	return;
+}
+
+// hashes size zero bytes, that's what holes of sparse entries contain
+static
+void hash_zeroes(sha256_ctx_t *ctx, off_t size) {
+	static const char zeroes[4096];
+	while (size > 0) {
+		size_t n = MIN((off_t)sizeof(zeroes), size);
+		sha256_update(ctx, zeroes, n);
+		size -= n;
+	}
+	return;
+}
+
+// Adds file data to the store. The data is taken from buf, or streamed
+// from ar if buf is NULL. Returns the object reference (to be freed), or
+// NULL on error with errno set.
+char *store_put(struct archive *ar, struct archive_entry *en,
+                const void *buf, size_t size) {
+	char ref[REF_MAX], *tmp, *obj;
+	sha256_ctx_t ctx;
+	const void *block;
+	off_t offset, pos = 0;
+	int fd, ret, err;
+
+	sha256_init(&ctx);
+	if (buf) {
+		// data is in memory, there is nothing to write if the
+		// object is already there
+		sha256_update(&ctx, buf, size);
+		make_ref(ref, &ctx, en);
+		obj = store_path(STORE_OBJECTS, ref);
+		if (!access(obj, F_OK)) {
+			free(obj);
+			return strdup(ref);
+		}
+		free(obj);
+	}
+
+	tmp = store_path(STORE_TMP, "objXXXXXX");
+	fd = mkstemp(tmp);
+	if (fd < 0) goto failed;
+
+	if (buf) {
+		if (write_all(fd, buf, size)) goto failed_fd;
+	}
+	else {
+		while ((ret = archive_read_data_block(ar, &block, &size,
+		                                      &offset)) == ARCHIVE_OK) {
+			hash_zeroes(&ctx, offset - pos);
+			sha256_update(&ctx, block, size);
+			pos = offset + size;
+			if (lseek(fd, offset, SEEK_SET) < 0 ||
+			    write_all(fd, block, size))
+				goto failed_fd;
+		}
+		if (ret != ARCHIVE_EOF) {
+			errno = EIO;
+			goto failed_fd;
+		}
+		hash_zeroes(&ctx, archive_entry_size(en) - pos);
+		if (ftruncate(fd, archive_entry_size(en))) goto failed_fd;
+		make_ref(ref, &ctx, en);
+	}
+
+	if (opt_store_link) {
+		if (fchown(fd, archive_entry_uid(en), archive_entry_gid(en)) ||
+		    fchmod(fd, archive_entry_mode(en) & 07777))
+			goto failed_fd;
+	}
+	else if (fchmod(fd, 0444)) goto failed_fd;
+	if (opt_sync != PKG_SYNC_NONE && fsync(fd)) goto failed_fd;
+	if (close(fd)) goto failed;
+
+	obj = store_path(STORE_OBJECTS, ref);
+	ret = rename(tmp, obj);
+	if (ret && errno == ENOENT) {
+		make_parents(obj);
+		ret = rename(tmp, obj);
+	}
+	err = errno;
+	free(obj);
+	if (ret) goto failed_errno;
+	free(tmp);
+	return strdup(ref);
+
+failed_fd:
+	err = errno;
+	close(fd);
+	errno = err;
+failed:
+	err = errno;
+failed_errno:
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return NULL;
+}
+
+// Installs object ref as the file described by en. Returns 0 on success,
+// -1 with errno set otherwise.
+int store_place(const char *ref, struct archive_entry *en) {
+	const char *path = archive_entry_pathname(en);
+	char *obj = store_path(STORE_OBJECTS, ref);
+	int src = -1, dst = -1, err;
+
+	if (unlink(path) && errno != ENOENT && errno != EISDIR) goto failed;
+
+	if (opt_store_link) {
+		if (!link(obj, path)) goto done;
+		if (errno == ENOENT) {
+			make_parents(path);
+			if (!link(obj, path)) goto done;
+		}
+		// different file system or too many links, copy it then
+		if (errno != EXDEV && errno != EMLINK && errno != EPERM)
+			goto failed;
+	}
+
+	src = open(obj, O_RDONLY | O_CLOEXEC);
+	if (src < 0) goto failed;
+	dst = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	           0600);
+	if (dst < 0 && errno == ENOENT) {
+		make_parents(path);
+		dst = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+		           O_CLOEXEC, 0600);
+	}
+	if (dst < 0 || copy_fd(src, dst) ||
+	    fchown(dst, archive_entry_uid(en), archive_entry_gid(en)) ||
+	    fchmod(dst, archive_entry_mode(en) & 07777) ||
+	    (opt_sync == PKG_SYNC_FULL && fsync(dst)))
+		goto failed;
+	if (close(dst)) {
+		dst = -1;
+		goto failed;
+	}
+	close(src);
+done:
+	free(obj);
+	return 0;
+failed:
+	err = errno;
+	if (src >= 0) close(src);
+	if (dst >= 0) close(dst);
+	free(obj);
+	errno = err;
+	return -1;
+}
+
+// Writes the index of the package just installed, if it had none.
+void store_end(pkg_desc_t *pkg) {
+	char *tmp;
+	FILE *f;
+	int fd;
+
+	if (!pkg_index_size) {
+		tmp = store_path(STORE_TMP, "idxXXXXXX");
+		fd = mkstemp(tmp);
+		if (fd >= 0 && !fchmod(fd, 0644) && (f = fdopen(fd, "w"))) {
+			fprintf(f, "%lld %lld\n", (long long)pkg_size,
+			        (long long)pkg_mtime);
+			list_for_each(_file, &pkg->files) {
+				pkg_file_t *file = _file->data;
+				if (file->ref)
+					fprintf(f, "%s %s\n", file->ref,
+					        file->path);
+			}
+			if (fclose(f) || rename(tmp, pkg_index_path))
+				unlink(tmp);
+		}
+		else if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+	}
+
+	for (size_t i = 0; i < pkg_index_size; i++) {
+		free(pkg_index[i].path);
+		free(pkg_index[i].ref);
+	}
+	free(pkg_index);
+	free(pkg_index_path);
+	return;
+}
@@ -0,0 +1,359 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pkgutils/pkgutils.h>
+
+// relative to the root. With opt_defer each unlink_begin() creates a
+// directory there, files are renamed into it and removed later, by
+// unlink_reclaim().
+#define TRASH_DIR          "."LOCALSTATEDIR"/lib/pkg/trash"
+
+#define UNLINK_MAX_WORKERS 16
+// files of the same directory are split into units of that size
+#define UNLINK_UNIT_SIZE   256
+// fewer files are not worth starting threads for
+#define UNLINK_MIN_THREADED 64
+
+// files of one directory, files[start] to files[end - 1]
+typedef struct {
+	size_t start;
+	size_t end;
+} unit_t;
+
+int opt_defer;
+
+static int root_fd = -1;
+static int trash_fd = -1;  // locked while files are moved into it
+static list_t files;
+static list_t dirs;
+
+static pkg_file_t **sorted;
+static unit_t *units;
+static size_t nunits;
+static size_t next_unit;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+void report_failure(const char *path, int err) {
+	fprintf(stderr, "Can't remove %s/%s: %s\n", opt_root, path,
+	        strerror(err));
+	return;
+}
+
+// length of the directory part of path, without the trailing slash
+static
+size_t dir_len(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return slash ? (size_t)(slash - path) : 0;
+}
+
+// groups files by directory, the order of directories doesn't matter
+static
+int dir_cmp(const void *a, const void *b) {
+	const char *patha = (*(pkg_file_t *const *)a)->path;
+	const char *pathb = (*(pkg_file_t *const *)b)->path;
+	size_t lena = dir_len(patha), lenb = dir_len(pathb);
+
+	if (lena != lenb) return lena < lenb ? -1 : 1;
+	return memcmp(patha, pathb, lena);
+}
+
+// deepest directories first
+static
+int rdir_cmp(const void *a, const void *b) {
+	return -strcmp((*(pkg_file_t *const *)a)->path,
+	               (*(pkg_file_t *const *)b)->path);
+}
+
+static
+void unlink_unit(unit_t *unit) {
+	const char *path = sorted[unit->start]->path;
+	size_t len = dir_len(path);
+	char *dir;
+	int dfd;
+
+	dir = fmalloc(len + 2);
+	if (len) {
+		memcpy(dir, path, len);
+		dir[len] = '\0';
+	}
+	else strcpy(dir, ".");
+	dfd = openat(root_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+
+	for (size_t i = unit->start; i < unit->end; i++) {
+		pkg_file_t *file = sorted[i];
+		const char *name = file->path + (len ? len + 1 : 0);
+		struct stat st;
+
+		if (dfd < 0 || fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+			report_failure(file->path, errno);
+			continue;
+		}
+		// remove() semantics: a directory where a file is expected
+		// is removed as well, if it's empty. It's left to
+		// unlink_dirs(), like symlinks to directories, so it's done
+		// after the files in it.
+		if (S_ISDIR(st.st_mode) || (S_ISLNK(st.st_mode) &&
+		    !fstatat(dfd, name, &st, 0) && S_ISDIR(st.st_mode))) {
+			pthread_mutex_lock(&lock);
+			list_append(&dirs, file);
+			pthread_mutex_unlock(&lock);
+			continue;
+		}
+		dbg("removing %s\n", file->path);
+		ldconfig_check_at(dfd, file->path, name);
+		if (trash_fd >= 0) {
+			char trash_name[32];
+			snprintf(trash_name, sizeof(trash_name), "%zx", i);
+			if (!renameat(dfd, name, trash_fd, trash_name))
+				continue;
+		}
+		if (unlinkat(dfd, name, 0)) report_failure(file->path, errno);
+	}
+	if (dfd >= 0) close(dfd);
+	return;
+}
+
+static
+void *worker(void *arg) {
+	unit_t *unit;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		unit = next_unit < nunits ? &units[next_unit++] : NULL;
+		pthread_mutex_unlock(&lock);
+		if (!unit) break;
+		unlink_unit(unit);
+	}
+	return NULL;
+}
+
+// Creates a new trash directory and leaves it open and locked, so
+// unlink_reclaim() doesn't remove it while it's filled. Files are just
+// unlinked if that fails.
+static
+void open_trash(void) {
+	char name[32];
+	int fd;
+
+	fd = openat(root_fd, TRASH_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT && !mkdirat(root_fd, TRASH_DIR, 0700))
+		fd = openat(root_fd, TRASH_DIR,
+		            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	for (unsigned int seq = 0; ; seq++) {
+		snprintf(name, sizeof(name), "%ld.%u", (long)getpid(), seq);
+		if (!mkdirat(fd, name, 0700)) break;
+		if (errno != EEXIST) {
+			close(fd);
+			return;
+		}
+	}
+	trash_fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	close(fd);
+	if (trash_fd >= 0 && flock(trash_fd, LOCK_EX)) {
+		close(trash_fd);
+		trash_fd = -1;
+	}
+	return;
+}
+
+// root is the directory paths are relative to, "" means "/"
+void unlink_begin(const char *root) {
+	root_fd = open(strcmp(root, "") ? root : "/",
+	               O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0) die("Can't open root directory");
+	if (opt_defer) open_trash();
+	list_init(&files);
+	list_init(&dirs);
+	return;
+}
+
+void unlink_file(pkg_file_t *file) {
+	list_append(S_ISDIR(file->mode) ? &dirs : &files, file);
+	return;
+}
+
+// sorts l with cmpf into an array of its files
+static
+pkg_file_t **sort_files(list_t *l, int (*cmpf)(const void *, const void *)) {
+	pkg_file_t **arr;
+	size_t cnt = 0;
+
+	arr = fmalloc((l->size ? l->size : 1) * sizeof(pkg_file_t *));
+	list_for_each(_file, l) arr[cnt++] = _file->data;
+	qsort(arr, cnt, sizeof(pkg_file_t *), cmpf);
+	return arr;
+}
+
+static
+void unlink_files(void) {
+	pthread_t workers[UNLINK_MAX_WORKERS];
+	size_t nfiles = files.size, nworkers = 0;
+
+	sorted = sort_files(&files, dir_cmp);
+	units = fmalloc((nfiles ? nfiles : 1) * sizeof(unit_t));
+	nunits = next_unit = 0;
+	for (size_t i = 0; i < nfiles; i++) {
+		if (!nunits || units[nunits-1].end - units[nunits-1].start ==
+		               UNLINK_UNIT_SIZE ||
+		    dir_cmp(&sorted[i], &sorted[i-1])) {
+			units[nunits].start = i;
+			nunits++;
+		}
+		units[nunits-1].end = i + 1;
+	}
+
+	// unlinking is bound by latency rather than CPU, so more threads
+	// than processors are used. The caller works as well.
+	if (nfiles >= UNLINK_MIN_THREADED) {
+		for (size_t i = 0; i < MIN(nunits - 1, UNLINK_MAX_WORKERS); i++) {
+			if (pthread_create(&workers[i], NULL, worker, NULL))
+				break;
+			nworkers++;
+		}
+	}
+	worker(NULL);
+	for (size_t i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+
+	free(units);
+	free(sorted);
+	return;
+}
+
+static
+void unlink_dirs(void) {
+	pkg_file_t **arr = sort_files(&dirs, rdir_cmp);
+
+	for (size_t i = 0; i < dirs.size; i++) {
+		dbg("removing %s\n", arr[i]->path);
+		if (unlinkat(root_fd, arr[i]->path, AT_REMOVEDIR) &&
+		    (errno != ENOTDIR || unlinkat(root_fd, arr[i]->path, 0)))
+			report_failure(arr[i]->path, errno);
+	}
+	free(arr);
+	return;
+}
+
+void unlink_end(void) {
+	unlink_files();
+	unlink_dirs();
+	list_free(&files);
+	list_free(&dirs);
+	if (trash_fd >= 0) close(trash_fd);
+	trash_fd = -1;
+	close(root_fd);
+	root_fd = -1;
+	return;
+}
+
+// lowest CPU and I/O priority, the reclaim must not slow anything down
+static
+void lower_priority(void) {
+	setpriority(PRIO_PROCESS, 0, 19);
+#ifdef SYS_ioprio_set
+	// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+	return;
+}
+
+// Removes the trash directories left by earlier unlink_end() calls, the
+// ones locked by running transactions are skipped.
+static
+void reclaim(DIR *dir) {
+	struct dirent *de;
+	int sub;
+
+	while ((de = readdir(dir))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		sub = openat(dirfd(dir), de->d_name, O_RDONLY | O_DIRECTORY);
+		if (sub < 0) continue;
+		if (!flock(sub, LOCK_EX | LOCK_NB)) remove_tree(de->d_name);
+		close(sub);
+	}
+	return;
+}
+
+// whether there is anything besides "." and ".." in dir
+static
+int has_entries(DIR *dir) {
+	struct dirent *de;
+
+	while ((de = readdir(dir)))
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			break;
+	rewinddir(dir);
+	return de != NULL;
+}
+
+// Starts removing the trash under root in a background process of low
+// priority, if there is any. Being called at the end of every run, it
+// also resumes the removal after an interrupted one.
+void unlink_reclaim(const char *root) {
+	char *path;
+	DIR *dir;
+	pid_t pid = 0;
+	int null;
+
+	path = fmalloc(strlen(root) + strlen(TRASH_DIR) + 2);
+	sprintf(path, "%s/%s", root, TRASH_DIR);
+	dir = opendir(path);
+	free(path);
+	if (!dir) return;
+	if (!has_entries(dir) || (pid = fork())) {
+		if (pid < 0)
+			fprintf(stderr, "Can't start trash removal: %s\n",
+			        strerror(errno));
+		closedir(dir);
+		return;
+	}
+
+	// failures are retried by the next run, nobody waits for this one
+	setsid();
+	null = open("/dev/null", O_RDWR);
+	if (null >= 0) {
+		dup2(null, 0);
+		dup2(null, 1);
+		dup2(null, 2);
+	}
+	lower_priority();
+	if (!fchdir(dirfd(dir))) reclaim(dir);
+	_exit(0);
+}
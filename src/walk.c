@@ -0,0 +1,516 @@
+//  Original pkgutils:
+//  Copyright (c) 2000-2005 Per Liden
+//
+//  That C-rewrite:
+//  Copyright (c) 2006 Anton Vorontsov <cbou@mail.ru>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 2 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program; if not, write to the Free Software
+//  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, 
+//  USA.
+
+// Ordered directory walker. Entries are reported in the order of their
+// full paths, as strcmp() sorts them, by the thread which called
+// walk_tree(), so the caller can merge them with other sorted data as
+// they come. Only the directories on the way to the current one, and a
+// bounded number of directories read ahead, are kept in memory.
+//
+// Reading is done by a pool of threads. Every thread owns a deque of
+// directories to read: it takes the most recently found ones from the
+// bottom of its own deque, which keeps its reads depth first, and steals
+// the oldest ones from the top of the others' deques when its own is
+// empty. Directories are read with getdents64() and opened relative to
+// the parent.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pkgutils/pkgutils.h>
+
+#define WALK_MAX_THREADS 16
+#define WALK_BUF_SIZE    (256 << 10)
+// directories read ahead of the walk, each keeps its descriptor open
+#define WALK_MAX_AHEAD   256
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+enum { DIR_NEW, DIR_QUEUED, DIR_READING, DIR_READY };
+
+typedef struct dir dir_t;
+
+// Entry of a directory. Directories have another one for their contents,
+// which sorts as the name followed by '/'.
+typedef struct {
+	const char *name;
+	size_t len;
+	char tail;   // '/' for the contents of a directory
+	int is_dir;
+	dir_t *dir;  // the directory to walk, for the contents
+} event_t;
+
+struct dir {
+	dir_t *parent;
+	char *path;  // relative to the root
+	size_t len;
+	int ctx;
+	int fd;      // kept open for the subdirectories to be opened
+	int state;
+	int ahead;   // counted in read_ahead
+	int refs;    // the parent and a deque may hold it
+	char *names;
+	event_t *events;
+	size_t nevents;
+	struct stat st;
+	int has_st;          // st is there, and the listing is complete
+	const char *cached;  // entries found in the cache
+	char *raw;           // entries read, for the cache
+};
+
+typedef struct {
+	pthread_mutex_t lock;
+	dir_t **items;
+	size_t top, bottom, size;  // items[top % size] to items[bottom - 1]
+} deque_t;
+
+// the deque after the readers' ones is filled by the walking thread
+static deque_t deques[WALK_MAX_THREADS + 1];
+static int nreaders;
+static scan_cache_t *walk_cache;
+static walk_filter_t walk_filter;
+static void *walk_arg;
+static int root_fd;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dir_ready = PTHREAD_COND_INITIALIZER;
+static size_t queued, read_ahead;
+static int finishing;
+
+static
+void push(deque_t *dq, dir_t *dir) {
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom - dq->top == dq->size) {
+		size_t size = dq->size ? dq->size * 2 : 64;
+		dir_t **items = fmalloc(size * sizeof(dir_t *));
+		for (size_t i = dq->top; i < dq->bottom; i++)
+			items[i % size] = dq->items[i % dq->size];
+		free(dq->items);
+		dq->items = items;
+		dq->size = size;
+	}
+	dq->items[dq->bottom++ % dq->size] = dir;
+	pthread_mutex_unlock(&dq->lock);
+	return;
+}
+
+static
+dir_t *take(deque_t *dq, int steal) {
+	dir_t *dir = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->bottom != dq->top) {
+		if (steal) dir = dq->items[dq->top++ % dq->size];
+		else dir = dq->items[--dq->bottom % dq->size];
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	if (dir) {
+		pthread_mutex_lock(&lock);
+		queued--;
+		pthread_mutex_unlock(&lock);
+	}
+	return dir;
+}
+
+// own work first, then the others'. Returns NULL when the walk is over.
+static
+dir_t *next_dir(int self) {
+	dir_t *dir;
+
+	for (;;) {
+		if ((dir = take(&deques[self], 0))) return dir;
+		for (int i = 1; i <= nreaders; i++)
+			if ((dir = take(&deques[(self + i) % (nreaders + 1)], 1)))
+				return dir;
+
+		pthread_mutex_lock(&lock);
+		while (!queued && !finishing)
+			pthread_cond_wait(&work_ready, &lock);
+		if (!queued && finishing) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+// must be called with the lock held
+static
+void put_dir(dir_t *dir) {
+	if (--dir->refs) return;
+	free(dir->path);
+	free(dir);
+	return;
+}
+
+// Queues the unread subdirectories of dir for the readers, as long as
+// there is room for them. self is the deque to use. Must be called with
+// the lock held: once dir is ready the walk may free its events.
+static
+void queue_subdirs(dir_t *dir, int self) {
+	for (size_t i = 0; i < dir->nevents; i++) {
+		dir_t *sub = dir->events[i].dir;
+		if (!sub || sub->state != DIR_NEW) continue;
+		if (read_ahead >= WALK_MAX_AHEAD) break;
+		sub->state = DIR_QUEUED;
+		sub->ahead = 1;
+		sub->refs++;
+		read_ahead++;
+		queued++;
+		push(&deques[self], sub);
+		pthread_cond_signal(&work_ready);
+	}
+	return;
+}
+
+static
+int key_cmp(const void *a, const void *b) {
+	const event_t *ea = a, *eb = b;
+	size_t n = MIN(ea->len, eb->len);
+	unsigned char ca, cb;
+	int cmp;
+
+	if ((cmp = memcmp(ea->name, eb->name, n))) return cmp;
+	// names can't contain '/', so the keys differ right there unless
+	// they are the same
+	ca = n < ea->len ? ea->name[n] : ea->tail;
+	cb = n < eb->len ? eb->name[n] : eb->tail;
+	return ca - cb;
+}
+
+static
+int open_dir(dir_t *dir) {
+	const char *name = dir->path + dir->len;
+	int fd;
+
+	if (!dir->parent) return dup(root_fd);
+	while (name > dir->path && name[-1] != '/') name--;
+	fd = openat(dir->parent->fd, name,
+	            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	// parents are kept open only to spare path lookups
+	if (fd < 0 && (errno == EMFILE || errno == ENFILE))
+		fd = openat(root_fd, dir->path,
+		            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	return fd;
+}
+
+// entries of a directory being read
+typedef struct {
+	char *child;      // path of the current entry
+	size_t len;       // of the directory part of child
+	char *names;      // names which passed the filter
+	size_t names_len, names_size;
+	size_t *offsets;  // offsets of the names, and their flags
+	int *flags;
+	size_t n, size;
+	char *raw;        // all entries, for the cache
+	size_t raw_len, raw_size;
+} listing_t;
+
+static
+void grow(char **buf, size_t *size, size_t need) {
+	if (need <= *size) return;
+	*size = MAX(*size * 2, MAX(need, 4096));
+	*buf = realloc(*buf, *size);
+	if (!*buf) die("realloc");
+	return;
+}
+
+static
+void add_entry(dir_t *dir, listing_t *l, const char *name, size_t name_len,
+               int is_dir, int cache) {
+	int ctx = dir->ctx;
+
+	if (cache) {
+		grow(&l->raw, &l->raw_size, l->raw_len + name_len + 3);
+		l->raw[l->raw_len++] = is_dir ? 'd' : '-';
+		memcpy(l->raw + l->raw_len, name, name_len + 1);
+		l->raw_len += name_len + 1;
+	}
+	if (l->len + name_len > MAXPATHLEN) return;
+	memcpy(l->child + l->len, name, name_len + 1);
+	if (!walk_filter(l->child, is_dir, &ctx, walk_arg)) return;
+
+	grow(&l->names, &l->names_size, l->names_len + name_len + 1);
+	if (l->n == l->size) {
+		l->size = MAX(l->size * 2, 64);
+		l->offsets = realloc(l->offsets, l->size * sizeof(size_t));
+		l->flags = realloc(l->flags, l->size * 2 * sizeof(int));
+		if (!l->offsets || !l->flags) die("realloc");
+	}
+	memcpy(l->names + l->names_len, name, name_len + 1);
+	l->offsets[l->n] = l->names_len;
+	l->flags[l->n * 2] = is_dir;
+	l->flags[l->n * 2 + 1] = ctx;
+	l->names_len += name_len + 1;
+	l->n++;
+	return;
+}
+
+// Reads entries of dir, from the cache if it's still valid there, and
+// sorts the ones which pass the filter. buf and child are the caller's
+// buffers, self is the deque to queue the subdirectories to.
+static
+void read_dir(dir_t *dir, char *buf, char *child, int self) {
+	listing_t l;
+	long nread = 0;
+	int fd, cache = 0;
+
+	memset(&l, 0, sizeof(l));
+	l.child = child;
+	l.len = dir->len;
+	memcpy(child, dir->path, l.len);
+	if (l.len) child[l.len++] = '/';
+
+	fd = open_dir(dir);
+	if (fd < 0 && errno != EACCES && errno != ENOENT) die(dir->path);
+	if (fd >= 0 && walk_cache && !fstat(fd, &dir->st)) {
+		dir->cached = scan_cache_lookup(walk_cache, dir->path,
+		                                &dir->st);
+		cache = !dir->cached;
+		dir->has_st = 1;
+	}
+
+	for (const char *p = dir->cached; p && *p; p += strlen(p) + 1)
+		add_entry(dir, &l, p + 1, strlen(p + 1), *p == 'd', 0);
+
+	while (fd >= 0 && !dir->cached &&
+	       (nread = syscall(SYS_getdents64, fd, buf, WALK_BUF_SIZE)) > 0) {
+		for (long off = 0; off < nread; ) {
+			struct linux_dirent64 *de = (void *)(buf + off);
+			size_t name_len = strlen(de->d_name);
+			int is_dir = de->d_type == DT_DIR;
+			struct stat st;
+
+			off += de->d_reclen;
+			if (de->d_name[0] == '.' && (name_len == 1 ||
+			    (name_len == 2 && de->d_name[1] == '.')))
+				continue;
+			if (de->d_type == DT_UNKNOWN &&
+			    !fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				is_dir = S_ISDIR(st.st_mode);
+			add_entry(dir, &l, de->d_name, name_len, is_dir, cache);
+		}
+	}
+	if (nread < 0) {
+		if (errno != EACCES) die(dir->path);
+		dir->has_st = 0;
+	}
+	if (cache) {
+		grow(&l.raw, &l.raw_size, l.raw_len + 1);
+		l.raw[l.raw_len] = '\0';
+		dir->raw = l.raw;
+	}
+
+	dir->events = fmalloc((l.n * 2 + 1) * sizeof(event_t));
+	dir->nevents = 0;
+	for (size_t i = 0; i < l.n; i++) {
+		event_t *ev = &dir->events[dir->nevents++];
+		dir_t *sub;
+
+		ev->name = l.names + l.offsets[i];
+		ev->len = strlen(ev->name);
+		ev->tail = '\0';
+		ev->is_dir = l.flags[i * 2];
+		ev->dir = NULL;
+		if (!ev->is_dir) continue;
+
+		sub = fmalloc(sizeof(dir_t));
+		memset(sub, 0, sizeof(dir_t));
+		sub->parent = dir;
+		sub->len = l.len + ev->len;
+		sub->path = fmalloc(sub->len + 1);
+		memcpy(sub->path, child, l.len);
+		memcpy(sub->path + l.len, ev->name, ev->len + 1);
+		sub->ctx = l.flags[i * 2 + 1];
+		sub->fd = -1;
+		sub->state = DIR_NEW;
+		sub->refs = 1;
+		dir->events[dir->nevents] = *ev;
+		dir->events[dir->nevents].tail = '/';
+		dir->events[dir->nevents].dir = sub;
+		dir->nevents++;
+	}
+	qsort(dir->events, dir->nevents, sizeof(event_t), key_cmp);
+	dir->names = l.names;
+	free(l.offsets);
+	free(l.flags);
+
+	if (fd >= 0 && l.n < dir->nevents) dir->fd = fd;
+	else if (fd >= 0) close(fd);
+
+	pthread_mutex_lock(&lock);
+	queue_subdirs(dir, self);
+	dir->state = DIR_READY;
+	pthread_cond_broadcast(&dir_ready);
+	pthread_mutex_unlock(&lock);
+	return;
+}
+
+static
+void *reader(void *arg) {
+	int self = (long)arg;
+	char *buf = fmalloc(WALK_BUF_SIZE);
+	char *child = fmalloc(MAXPATHLEN+2);
+	dir_t *dir;
+	int claimed;
+
+	while ((dir = next_dir(self))) {
+		pthread_mutex_lock(&lock);
+		// the walk might have got there first
+		if ((claimed = dir->state == DIR_QUEUED))
+			dir->state = DIR_READING;
+		pthread_mutex_unlock(&lock);
+		if (claimed) read_dir(dir, buf, child, self);
+		pthread_mutex_lock(&lock);
+		put_dir(dir);
+		pthread_mutex_unlock(&lock);
+	}
+	free(child);
+	free(buf);
+	return NULL;
+}
+
+// Reports entries of dir and everything under it, in order. path holds
+// the path of dir.
+static
+void walk_dir(dir_t *dir, walk_func_t func, char *path, char *buf) {
+	size_t len = dir->len;
+	int claimed;
+
+	pthread_mutex_lock(&lock);
+	if ((claimed = dir->state == DIR_NEW || dir->state == DIR_QUEUED))
+		dir->state = DIR_READING;
+	while (!claimed && dir->state != DIR_READY)
+		pthread_cond_wait(&dir_ready, &lock);
+	pthread_mutex_unlock(&lock);
+	if (claimed) read_dir(dir, buf, path + MAXPATHLEN+2, nreaders);
+	// the reader might have had no room for them
+	pthread_mutex_lock(&lock);
+	queue_subdirs(dir, nreaders);
+	pthread_mutex_unlock(&lock);
+	// directories are walked in the order the cache keeps them
+	if (dir->has_st)
+		scan_cache_put(walk_cache, dir->path, &dir->st,
+		               dir->cached ? dir->cached : dir->raw);
+
+	if (len) path[len++] = '/';
+	for (size_t i = 0; i < dir->nevents; i++) {
+		event_t *ev = &dir->events[i];
+		memcpy(path + len, ev->name, ev->len + 1);
+		if (ev->dir) walk_dir(ev->dir, func, path, buf);
+		else func(path, ev->is_dir, walk_arg);
+	}
+
+	pthread_mutex_lock(&lock);
+	if (dir->ahead) read_ahead--;
+	for (size_t i = 0; i < dir->nevents; i++)
+		if (dir->events[i].dir) put_dir(dir->events[i].dir);
+	pthread_mutex_unlock(&lock);
+	if (dir->fd >= 0) close(dir->fd);
+	free(dir->events);
+	free(dir->names);
+	free(dir->raw);
+	return;
+}
+
+// Walks the tree under root. filter is called for every entry, func for
+// the ones which passed it, in order. Symlinks to directories are not
+// followed, unreadable directories are skipped. Listings are taken from
+// cache, and written to it, if it's not NULL.
+void walk_tree(const char *root, scan_cache_t *cache, walk_filter_t filter,
+               walk_func_t func, int ctx, void *arg) {
+	pthread_t threads[WALK_MAX_THREADS];
+	dir_t top;
+	char *path, *buf;
+	long ncpus;
+	int started;
+
+	walk_cache = cache;
+	walk_filter = filter;
+	walk_arg = arg;
+	root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root_fd < 0) {
+		if (errno == EACCES) return;
+		die(root);
+	}
+
+	memset(&top, 0, sizeof(top));
+	top.path = "";
+	top.ctx = ctx;
+	top.fd = -1;
+	top.state = DIR_NEW;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nreaders = MAX(1, MIN(ncpus, WALK_MAX_THREADS));
+	for (int i = 0; i <= nreaders; i++) {
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].items = NULL;
+		deques[i].top = deques[i].bottom = deques[i].size = 0;
+	}
+	queued = read_ahead = 0;
+	finishing = 0;
+	// deques of the readers which failed to start just stay empty
+	for (started = 0; started < nreaders; started++)
+		if (pthread_create(&threads[started], NULL, reader,
+		                   (void *)(long)started))
+			break;
+
+	// the path being reported, and the buffer for the names read
+	path = fmalloc(2 * (MAXPATHLEN+2));
+	buf = fmalloc(WALK_BUF_SIZE);
+	walk_dir(&top, func, path, buf);
+	free(buf);
+	free(path);
+
+	pthread_mutex_lock(&lock);
+	finishing = 1;
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&lock);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// whatever is left in the deques was already walked
+	for (int i = 0; i <= nreaders; i++) {
+		dir_t *dir;
+		while ((dir = take(&deques[i], 1))) put_dir(dir);
+		free(deques[i].items);
+		pthread_mutex_destroy(&deques[i].lock);
+	}
+	close(root_fd);
+	return;
+}
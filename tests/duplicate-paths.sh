@@ -0,0 +1,38 @@
+#!/bin/sh
+# Installs a package with entries of the same path, the last one of which
+# must win although the writers extract files in parallel, and whose
+# owner is given by name.
+
+B=${top_builddir:-..}/src
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+
+fail() {
+	echo "FAIL: $*"
+	[ -s "$T/err" ] && cat "$T/err"
+	exit 1
+}
+
+mkdir -p "$T/pkg/usr/bin" "$T/root/var/lib/pkg" || exit 1
+: > "$T/root/var/lib/pkg/db"
+for i in 1 2 3; do
+	if [ $i = 3 ]; then
+		echo last > "$T/pkg/usr/bin/x"
+	else
+		head -c $((i << 20)) /dev/zero | tr '\0' $i > "$T/pkg/usr/bin/x"
+	fi
+	(cd "$T/pkg" && tar rf "$T/x.tar" --owner=root:4321 \
+		--group=root:4321 usr/bin/x) || exit 1
+done
+gzip -c "$T/x.tar" > "$T/x#1-1.pkg.tar.gz" || exit 1
+
+$B/pkgadd -r "$T/root" "$T/x#1-1.pkg.tar.gz" 2> "$T/err" ||
+	fail "pkgadd failed"
+[ "$(cat "$T/root/usr/bin/x")" = last ] ||
+	fail "usr/bin/x is not the last entry"
+if [ "$(id -u)" = 0 ]; then
+	[ "$(stat -c %u:%g "$T/root/usr/bin/x")" = 0:0 ] ||
+		fail "usr/bin/x is not owned by root"
+fi
+
+exit 0
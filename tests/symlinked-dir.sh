@@ -0,0 +1,48 @@
+#!/bin/sh
+# Installs a package over a directory which is a symlink to a directory
+# on the file system, like lib64 -> usr/lib, which must be kept and not
+# reported.
+
+B=${top_builddir:-..}/src
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+
+fail() {
+	echo "FAIL: $*"
+	[ -s "$T/err" ] && cat "$T/err"
+	exit 1
+}
+
+# makes an empty root with lib64 -> usr/lib
+new_root() {
+	rm -rf "$T/root"
+	mkdir -p "$T/root/var/lib/pkg" "$T/root/usr/lib" || exit 1
+	: > "$T/root/var/lib/pkg/db"
+	ln -s usr/lib "$T/root/lib64"
+}
+
+check_root() {
+	[ -s "$T/err" ] && fail "$1: unexpected messages"
+	[ -L "$T/root/lib64" ] || fail "$1: lib64 is not a symlink anymore"
+	[ -f "$T/root/usr/lib/libx.so" ] || fail "$1: lib64/libx.so missing"
+	grep -q '^lib64/libx.so$' "$T/root/var/lib/pkg/db" ||
+		fail "$1: lib64/libx.so not in the database"
+}
+
+mkdir -p "$T/pkg/lib64"
+echo x > "$T/pkg/lib64/libx.so"
+(cd "$T/pkg" && tar czf "$T/x#1-1.pkg.tar.gz" --no-recursion \
+	lib64 lib64/libx.so) || exit 1
+
+new_root
+$B/pkgadd -r "$T/root" "$T/x#1-1.pkg.tar.gz" 2> "$T/err" ||
+	fail "pkgadd failed"
+check_root "pkgadd"
+
+# read from a stream, so staged
+new_root
+$B/pkgadd -r "$T/root" -n "x#1-1.pkg.tar.gz" - < "$T/x#1-1.pkg.tar.gz" \
+	2> "$T/err" || fail "pkgadd - failed"
+check_root "pkgadd -"
+
+exit 0